@@ -1,24 +1,59 @@
 // Lua Parser.cpp
 // Modified to add interactive "benchmark" mode
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define LUAP_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LUAP_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LUAP_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
 using namespace std;
 using sv = string_view;
 
 // ---------------- Types ----------------
-enum class TokenType {
+enum class TokenType : uint8_t {
     LEFT_PAREN,
     RIGHT_PAREN,
     LEFT_BRACE,
@@ -76,10 +111,391 @@ enum class TokenType {
 struct Token {
     TokenType type;
     sv text;  // points into original source
-    int line;
+    uint32_t offset;  // byte offset of `text`; see LineIndex for line/column
+};
+
+// Value of a NUMBER token, decoded once by the lexer with Lua 5.4 rules: a
+// '.', exponent or hex 'p' makes a float, hex integers wrap modulo 2^64 and
+// decimal integers that overflow become floats.
+struct LuaNumber {
+    enum class Kind : uint8_t { Invalid, Int, Float };  // Invalid: e.g. "0x"
+    Kind kind = Kind::Invalid;
+    union {
+        int64_t i = 0;
+        double f;
+    };
+
+    static LuaNumber integer(int64_t v) noexcept {
+        LuaNumber n;
+        n.kind = Kind::Int;
+        n.i = v;
+        return n;
+    }
+    static LuaNumber real(double v) noexcept {
+        LuaNumber n;
+        n.kind = Kind::Float;
+        n.f = v;
+        return n;
+    }
+    bool isInt() const noexcept { return kind == Kind::Int; }
+    bool isFloat() const noexcept { return kind == Kind::Float; }
+    double toDouble() const noexcept { return isInt() ? double(i) : f; }
+};
+
+LuaNumber decodeNumber(const char* p, size_t n) noexcept;
+inline LuaNumber decodeNumber(sv text) noexcept {
+    return decodeNumber(text.data(), text.size());
+}
+
+// aux flags of STRING tokens
+enum : uint32_t {
+    kStrLong = 1,    // [[...]] / [=[...]=] form
+    kStrDecode = 2,  // value differs from the raw bytes (escapes, newlines)
+};
+
+// Bump allocator for AST nodes and decoded strings. Nothing is freed (or
+// destroyed) individually; everything goes when the arena does. Moving an
+// arena keeps its allocations in place.
+class Arena {
+   public:
+    explicit Arena(size_t blockSize = 64 * 1024) : blockSize(blockSize) {}
+
+    // `align` must be a power of two no larger than alignof(max_align_t)
+    char* alloc(size_t n, size_t align = 1) {
+        size_t pad = (0 - (uintptr_t)cur) & (align - 1);
+        if (n + pad > left) {
+            size_t size = max(n, blockSize);
+            blocks.emplace_back(new char[size]);
+            cur = blocks.back().get();
+            left = size;
+            pad = 0;
+        }
+        char* p = cur + pad;
+        cur = p + n;
+        left -= n + pad;
+        used += n + pad;
+        return p;
+    }
+    template <class T>
+    T* allocArray(size_t n) {
+        static_assert(is_trivially_destructible<T>::value,
+                      "arena objects are never destroyed");
+        T* p = reinterpret_cast<T*>(alloc(n * sizeof(T), alignof(T)));
+        uninitialized_value_construct_n(p, n);
+        return p;
+    }
+    sv copy(sv text) {
+        char* p = alloc(text.size());
+        if (!text.empty()) memcpy(p, text.data(), text.size());
+        return sv(p, text.size());
+    }
+
+    size_t bytesUsed() const noexcept { return used; }
+    size_t blockCount() const noexcept { return blocks.size(); }
+
+    // Takes over everything `other` allocated; it is left empty.
+    void adopt(Arena&& other) {
+        for (auto& b : other.blocks) blocks.push_back(move(b));
+        used += other.used;
+        other.blocks.clear();
+        other.cur = nullptr;
+        other.left = other.used = 0;
+    }
+
+   private:
+    vector<unique_ptr<char[]>> blocks;
+    char* cur = nullptr;
+    size_t left = 0;
+    size_t used = 0;
+    size_t blockSize;
+};
+
+// Symbol id for nodes and tokens that have no interned name.
+static constexpr uint32_t kNoSymbol = UINT32_MAX;
+
+// Interns identifier names to dense 32-bit ids (0, 1, 2, ... in first-seen
+// order) so names compare as integers and each distinct name is stored once.
+// intern() and name() are not synchronized; lexers working concurrently
+// intern into private tables and fold them in with absorb(), which is.
+class SymbolTable {
+   public:
+    SymbolTable() : slots(1024) {}
+
+    uint32_t intern(sv name) {
+        ++lookups_;
+        uint32_t h = hashName(name);
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            Slot& s = slots[i];
+            if (s.id == kNoSymbol) return insert(s, h, name);
+            if (s.hash == h && names[s.id] == name) {
+                ++hits_;
+                return s.id;
+            }
+        }
+    }
+    sv name(uint32_t id) const noexcept { return names[id]; }
+    size_t size() const noexcept { return names.size(); }
+    uint64_t lookups() const noexcept { return lookups_; }
+    uint64_t hits() const noexcept { return hits_; }
+
+    // Interns the names of the `local` ids in `order`, in that order, and
+    // counts `uses` lookups for them in all, as if they had been interned
+    // here as they were used; returns the id each local id maps to
+    // (kNoSymbol for ids not in `order`).
+    vector<uint32_t> absorb(const SymbolTable& local,
+                            const vector<uint32_t>& order, uint64_t uses) {
+        lock_guard<mutex> guard(absorbLock);
+        vector<uint32_t> remap(local.size(), kNoSymbol);
+        for (uint32_t id : order) remap[id] = intern(local.name(id));
+        lookups_ += uses - order.size();
+        hits_ += uses - order.size();
+        return remap;
+    }
+
+   private:
+    struct Slot {
+        uint32_t hash = 0;
+        uint32_t id = kNoSymbol;
+    };
+
+    static uint32_t hashName(sv s) noexcept {
+        const char* p = s.data();
+        size_t n = s.size(), i = 0;
+        uint64_t h = 0x9E3779B97F4A7C15ull ^ n;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            h = (h ^ w) * 0xBF58476D1CE4E5B9ull;
+            h ^= h >> 31;
+        }
+        uint64_t w = 0;
+        memcpy(&w, p + i, n - i);
+        h = (h ^ w) * 0x94D049BB133111EBull;
+        return uint32_t(h ^ (h >> 32));
+    }
+
+    uint32_t insert(Slot& s, uint32_t h, sv name) {
+        char* copy = arena.alloc(name.size());
+        memcpy(copy, name.data(), name.size());
+        s = Slot{h, (uint32_t)names.size()};
+        names.emplace_back(copy, name.size());
+        if (names.size() * 2 > slots.size()) grow();
+        return (uint32_t)names.size() - 1;
+    }
+    void grow() {
+        vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot& s : old) {
+            if (s.id == kNoSymbol) continue;
+            size_t i = s.hash & mask;
+            while (slots[i].id != kNoSymbol) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+
+    vector<Slot> slots;  // open addressing, power-of-two size
+    vector<sv> names;    // id -> name (in `arena`)
+    Arena arena{16 * 1024};
+    uint64_t lookups_ = 0, hits_ = 0;
+    mutex absorbLock;
+};
+
+// Process-wide table the lexers intern into unless given another one.
+SymbolTable& globalSymbols() {
+    static SymbolTable table;
+    return table;
+}
+
+// Value of a string literal. Literals without escapes are used zero-copy
+// from the source; the others are decoded into an arena by value(), once
+// per call (AST nodes keep the copy their builder decoded).
+struct LuaString {
+    sv raw;              // bytes between the delimiters, in the source
+    uint32_t flags = 0;  // kStrLong / kStrDecode
+
+    LuaString() = default;
+    LuaString(sv raw, uint32_t flags) : raw(raw), flags(flags) {}
+
+    bool zeroCopy() const noexcept { return !(flags & kStrDecode); }
+    // decoded value; `arena` must outlive every use of the result
+    sv value(Arena& arena) const;
+};
+
+// Offset used for synthesized nodes that have no source position.
+static constexpr uint32_t kNoOffset = UINT32_MAX;
+
+// Newline table for a source buffer. Positions are stored as byte offsets
+// everywhere; line and column are only resolved here, on demand.
+class LineIndex {
+   public:
+    LineIndex() = default;
+    LineIndex(const char* data, size_t len);
+    explicit LineIndex(sv code) : LineIndex(code.data(), code.size()) {}
+
+    // 1-based line of `offset` (0 for kNoOffset)
+    int line(uint32_t offset) const noexcept {
+        if (offset == kNoOffset) return 0;
+        return int(upper_bound(starts.begin(), starts.end(), offset) -
+                   starts.begin());
+    }
+    // 1-based byte column of `offset` (0 for kNoOffset)
+    int column(uint32_t offset) const noexcept {
+        if (offset == kNoOffset) return 0;
+        return int(offset - starts[line(offset) - 1]) + 1;
+    }
+    size_t lineCount() const noexcept { return starts.size(); }
+    // offset of the first byte of 1-based `line`
+    uint32_t lineStart(int line) const noexcept { return starts[line - 1]; }
+
+    // Follows an edit of the source (now at `data`): bytes [at, at + removed)
+    // were replaced by `inserted` bytes.
+    void replace(const char* data, uint32_t at, uint32_t removed,
+                 uint32_t inserted) {
+        auto lo = upper_bound(starts.begin(), starts.end(), at);
+        auto hi = upper_bound(lo, starts.end(), at + removed);
+        uint32_t shift = inserted - removed;  // wraps for shrinking edits
+        for (auto it = hi; it != starts.end(); ++it) *it += shift;
+        vector<uint32_t> added;
+        const char* end = data + at + inserted;
+        for (const char* p = data + at;
+             (p = (const char*)memchr(p, '\n', size_t(end - p))); ++p)
+            added.push_back(uint32_t(p - data + 1));
+        size_t i = size_t(lo - starts.begin());
+        starts.erase(lo, hi);
+        starts.insert(starts.begin() + i, added.begin(), added.end());
+    }
+
+    // from precomputed line starts (starts[0] must be 0)
+    static LineIndex fromStarts(vector<uint32_t> starts) {
+        LineIndex li;
+        li.starts = move(starts);
+        return li;
+    }
+
+   private:
+    vector<uint32_t> starts{0};  // offset of the first byte of each line
+};
+
+// Structure-of-arrays token storage. The parser's lookahead mostly reads only
+// the token type, so types live in their own dense byte array and the text
+// spans sit on the side until a node is actually built. Offsets are 32-bit,
+// so a single source is limited to 4 GiB.
+struct TokenStream {
+    const char* base = nullptr;  // source the offsets point into
+    SymbolTable* symbols = nullptr;  // table the identifiers were interned in
+    vector<TokenType> types;
+    vector<uint32_t> offsets;
+    vector<uint32_t> lengths;
+    // per-token payload: NUMBER -> `numbers` index, STRING -> kStr* flags,
+    // IDENTIFIER -> symbol id in `symbols`
+    vector<uint32_t> aux;
+    vector<LuaNumber> numbers;  // decoded NUMBER values, in token order
+    LineIndex lines;  // built once per source, queried lazily
+
+    size_t size() const noexcept { return types.size(); }
+    bool has(size_t i) const noexcept { return i < types.size(); }
+    TokenType type(size_t i) const noexcept { return types[i]; }
+    sv text(size_t i) const noexcept {
+        return sv(base + offsets[i], lengths[i]);
+    }
+    uint32_t offset(size_t i) const noexcept { return offsets[i]; }
+    LuaNumber number(size_t i) const noexcept { return numbers[aux[i]]; }
+    LuaString str(size_t i) const noexcept {
+        return LuaString{text(i), aux[i]};
+    }
+    uint32_t symbol(size_t i) const noexcept { return aux[i]; }
+    Token operator[](size_t i) const noexcept {
+        return Token{types[i], text(i), offsets[i]};
+    }
+
+    void reserve(size_t n) {
+        types.reserve(n);
+        offsets.reserve(n);
+        lengths.reserve(n);
+        aux.reserve(n);
+    }
+    void push(TokenType t, size_t offset, size_t length, uint32_t a = 0) {
+        types.push_back(t);
+        offsets.push_back((uint32_t)offset);
+        lengths.push_back((uint32_t)length);
+        aux.push_back(a);
+    }
+    void pushNumber(size_t offset, size_t length, LuaNumber v) {
+        push(TokenType::NUMBER, offset, length, (uint32_t)numbers.size());
+        numbers.push_back(v);
+    }
+
+    // Replaces tokens [from, to) with all of `with`'s (lexed into the same
+    // source and symbol table) and moves the offsets of the tokens after
+    // them by `shift` bytes (modulo 2^32, so shrinking edits wrap).
+    void splice(size_t from, size_t to, const TokenStream& with,
+                uint32_t shift) {
+        // numbers are stored in token order: find the run [nb0, nb1)
+        // owned by the replaced tokens
+        auto numberAt = [&](size_t k) {
+            for (; k < size(); ++k)
+                if (types[k] == TokenType::NUMBER) return size_t(aux[k]);
+            return numbers.size();
+        };
+        size_t nb0 = numberAt(from), nb1 = nb0;
+        for (size_t k = from; k < to; ++k)
+            if (types[k] == TokenType::NUMBER) nb1 = aux[k] + 1;
+        uint32_t numShift = uint32_t(with.numbers.size() - (nb1 - nb0));
+
+        auto replace = [&](auto& v, const auto& w, size_t b, size_t e) {
+            if (e - b == w.size()) {
+                copy(w.begin(), w.end(), v.begin() + b);
+            } else {
+                v.erase(v.begin() + b, v.begin() + e);
+                v.insert(v.begin() + b, w.begin(), w.end());
+            }
+        };
+        replace(types, with.types, from, to);
+        replace(offsets, with.offsets, from, to);
+        replace(lengths, with.lengths, from, to);
+        replace(aux, with.aux, from, to);
+        replace(numbers, with.numbers, nb0, nb1);
+
+        size_t tail = from + with.size();
+        for (size_t k = from; k < tail; ++k)
+            if (types[k] == TokenType::NUMBER) aux[k] += uint32_t(nb0);
+        for (size_t k = tail; k < size(); ++k) offsets[k] += shift;
+        if (numShift)
+            for (size_t k = tail; k < size(); ++k)
+                if (types[k] == TokenType::NUMBER) aux[k] += numShift;
+    }
+
+    // materialize the classic array-of-structs form
+    vector<Token> toVector() const {
+        vector<Token> v;
+        v.reserve(size());
+        for (size_t i = 0; i < size(); ++i) v.push_back((*this)[i]);
+        return v;
+    }
+};
+
+// Adapts a plain vector<Token> to the accessors the parser uses.
+struct TokenVectorView {
+    const vector<Token>& tokens;
+
+    size_t size() const noexcept { return tokens.size(); }
+    bool has(size_t i) const noexcept { return i < tokens.size(); }
+    TokenType type(size_t i) const noexcept { return tokens[i].type; }
+    sv text(size_t i) const noexcept { return tokens[i].text; }
+    uint32_t offset(size_t i) const noexcept { return tokens[i].offset; }
+    LuaNumber number(size_t i) const noexcept {
+        return decodeNumber(tokens[i].text);
+    }
+    LuaString str(size_t i) const noexcept;
+    uint32_t symbol(size_t i) const {
+        return globalSymbols().intern(tokens[i].text);
+    }
+    const Token& operator[](size_t i) const noexcept { return tokens[i]; }
 };
 
-enum class ASTType {
+enum class ASTType : uint8_t {
     // statements / top-level
     Chunk,
     Block,
@@ -126,13 +542,152 @@ enum class ASTType {
     VariableAttribute
 };
 
+// Named child slots. Each node type has a fixed set of them (kSlotLayouts),
+// in the order they are printed.
+enum class Slot : uint8_t {
+    Variables,
+    Values,
+    Clauses,
+    Condition,
+    Body,
+    Statements,
+    Name,
+    Params,
+    Expression,
+    Object,
+    Property,
+    Index,
+    Callee,
+    Arguments,
+    Left,
+    Right,
+    Argument,
+    Value,
+    Fields
+};
+
+static constexpr const char* kSlotNames[] = {
+    "variables",  "values", "clauses",  "condition",  "body",
+    "statements", "name",   "params",   "expression", "object",
+    "property",   "index",  "callee",   "arguments",  "left",
+    "right",      "argument", "value",  "fields"};
+
+static_assert(sizeof(kSlotNames) / sizeof(kSlotNames[0]) ==
+                  size_t(Slot::Fields) + 1,
+              "one name per slot");
+
+inline const char* slotName(Slot s) noexcept { return kSlotNames[size_t(s)]; }
+
+struct SlotLayout {
+    uint8_t count;
+    Slot slots[3];
+};
+
+static constexpr SlotLayout slotLayout(ASTType t) {
+    switch (t) {
+        case ASTType::Chunk:
+        case ASTType::Block:
+            return {1, {Slot::Statements}};
+        case ASTType::LocalStatement:
+        case ASTType::AssignmentStatement:
+            return {2, {Slot::Variables, Slot::Values}};
+        case ASTType::ReturnStatement:
+            return {1, {Slot::Values}};
+        case ASTType::IfStatement:
+            return {1, {Slot::Clauses}};
+        case ASTType::IfClause:
+        case ASTType::ElseifClause:
+        case ASTType::WhileStatement:
+            return {2, {Slot::Condition, Slot::Body}};
+        case ASTType::ElseClause:
+            return {1, {Slot::Body}};
+        case ASTType::FunctionDeclaration:
+            return {3, {Slot::Name, Slot::Params, Slot::Body}};
+        case ASTType::FunctionExpression:
+            return {2, {Slot::Params, Slot::Body}};
+        case ASTType::CallStatement:
+            return {1, {Slot::Expression}};
+        case ASTType::MemberExpression:
+            return {2, {Slot::Object, Slot::Property}};
+        case ASTType::IndexExpression:
+            return {2, {Slot::Object, Slot::Index}};
+        case ASTType::CallExpression:
+            return {2, {Slot::Callee, Slot::Arguments}};
+        case ASTType::BinaryExpression:
+            return {2, {Slot::Left, Slot::Right}};
+        case ASTType::UnaryExpression:
+            return {1, {Slot::Argument}};
+        case ASTType::TableValue:
+            return {1, {Slot::Value}};
+        case ASTType::TableConstructorExpression:
+            return {1, {Slot::Fields}};
+        default:
+            return {0, {}};
+    }
+}
+
+static constexpr size_t kASTTypeCount = size_t(ASTType::VariableAttribute) + 1;
+
+struct SlotLayoutTable {
+    SlotLayout layouts[kASTTypeCount];
+};
+
+static constexpr SlotLayoutTable makeSlotLayoutTable() {
+    SlotLayoutTable t{};
+    for (size_t i = 0; i < kASTTypeCount; ++i)
+        t.layouts[i] = slotLayout(ASTType(i));
+    return t;
+}
+
+static constexpr SlotLayoutTable kSlotLayouts = makeSlotLayoutTable();
+
+struct AST;
+
+// Children in one slot. A slot can be absent (not printed) or present but
+// empty, which prints as [].
+struct ChildList {
+    AST* const* items = nullptr;
+    uint32_t count = 0;
+    bool present = false;
+
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    const AST& operator[](size_t i) const noexcept { return *items[i]; }
+    AST* const* begin() const noexcept { return items; }
+    AST* const* end() const noexcept { return items + count; }
+};
+
+// AST node. Nodes, their text and their slot arrays live in the Arena of
+// the ParseTree that produced them.
 struct AST {
     ASTType type;
-    string text;
-    int line;
+    uint8_t strFlags = 0;  // StringLiteral: kStrLong / kStrDecode
+    uint32_t offset;  // source position, resolved through LineIndex
+    uint32_t symbol = kNoSymbol;  // Identifier id in the lexer's SymbolTable
+    uint32_t decodedLen = 0;
+    sv text;
+    LuaNumber number;  // NumericLiteral value
+    const char* decoded = nullptr;  // kStrDecode literal value, in the arena
+    ChildList* slots = nullptr;  // one per entry of kSlotLayouts[type]
+
+    // StringLiteral value: `text` itself unless it had to be decoded
+    sv value() const noexcept {
+        return strFlags & kStrDecode ? sv(decoded, decodedLen) : text;
+    }
+    LuaString str() const noexcept { return LuaString(text, strFlags); }
 
-    // named slots -> lists of child nodes
-    unordered_map<string, vector<AST>> children;
+    const SlotLayout& layout() const noexcept {
+        return kSlotLayouts.layouts[size_t(type)];
+    }
+    // children in slot `s`; empty if absent or not a slot of this type
+    const ChildList& children(Slot s) const noexcept {
+        static const ChildList none;
+        const SlotLayout& l = layout();
+        for (uint8_t k = 0; k < l.count; ++k)
+            if (l.slots[k] == s) return slots[k];
+        return none;
+    }
+    const ChildList& slot(uint8_t k) const noexcept { return slots[k]; }
 };
 
 // ---------------- Helpers ----------------
@@ -141,15 +696,112 @@ static inline char hexDigit(unsigned v) noexcept {
     return H[v & 0xF];
 }
 
-static inline bool is_alpha(char c) noexcept {
-    return (c == '_') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+// 256-entry character classes, generated at compile time.
+enum : uint8_t {
+    CC_SPACE = 1,  // whitespace and other control bytes (<= 0x20)
+    CC_ALPHA = 2,  // identifier start: letters and '_'
+    CC_DIGIT = 4,
+    CC_XDIGIT = 8
+};
+
+struct CharClassTable {
+    uint8_t bits[256];
+};
+
+static constexpr CharClassTable makeCharClassTable() {
+    CharClassTable t{};
+    for (int c = 0; c < 256; ++c) {
+        uint8_t b = 0;
+        if (c <= 0x20) b |= CC_SPACE;
+        if (c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+            b |= CC_ALPHA;
+        if (c >= '0' && c <= '9') b |= CC_DIGIT | CC_XDIGIT;
+        if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) b |= CC_XDIGIT;
+        t.bits[c] = b;
+    }
+    return t;
+}
+
+static constexpr CharClassTable kCharClass = makeCharClassTable();
+
+static inline uint8_t charClass(char c) noexcept {
+    return kCharClass.bits[(unsigned char)c];
+}
+static inline bool is_alpha(char c) noexcept { return charClass(c) & CC_ALPHA; }
+static inline bool is_digit(char c) noexcept { return charClass(c) & CC_DIGIT; }
+static inline bool is_xdigit(char c) noexcept {
+    return charClass(c) & CC_XDIGIT;
 }
-static inline bool is_digit(char c) noexcept { return (c >= '0' && c <= '9'); }
 static inline bool is_alnum(char c) noexcept {
-    return is_alpha(c) || is_digit(c);
+    return charClass(c) & (CC_ALPHA | CC_DIGIT);
+}
+
+// Keyword lookup: a perfect hash over the 22 Lua keywords built from the
+// first byte, the last byte and the length, confirmed with one memcmp.
+struct KeywordEntry {
+    const char* text = nullptr;
+    size_t len = 0;
+    TokenType type = TokenType::IDENTIFIER;
+};
+
+static constexpr KeywordEntry kKeywords[] = {
+    {"and", 3, TokenType::AND},       {"break", 5, TokenType::BREAK},
+    {"do", 2, TokenType::DO},         {"else", 4, TokenType::ELSE},
+    {"elseif", 6, TokenType::ELSEIF}, {"end", 3, TokenType::END},
+    {"false", 5, TokenType::FALSE_},  {"for", 3, TokenType::FOR},
+    {"function", 8, TokenType::FUNCTION},
+    {"goto", 4, TokenType::GOTO},     {"if", 2, TokenType::IF},
+    {"in", 2, TokenType::IN},         {"local", 5, TokenType::LOCAL},
+    {"nil", 3, TokenType::NIL},       {"not", 3, TokenType::NOT},
+    {"or", 2, TokenType::OR},         {"repeat", 6, TokenType::REPEAT},
+    {"return", 6, TokenType::RETURN}, {"then", 4, TokenType::THEN},
+    {"true", 4, TokenType::TRUE_},    {"until", 5, TokenType::UNTIL},
+    {"while", 5, TokenType::WHILE},
+};
+
+static constexpr unsigned keywordHash(const char* w, size_t n) noexcept {
+    return ((unsigned char)w[0] + (unsigned char)w[n - 1] + (n << 3)) & 63;
+}
+
+struct KeywordTable {
+    KeywordEntry slots[64];
+};
+
+static constexpr KeywordTable makeKeywordTable() {
+    KeywordTable t{};
+    for (const KeywordEntry& k : kKeywords)
+        t.slots[keywordHash(k.text, k.len)] = k;
+    return t;
 }
 
+static constexpr bool keywordHashIsPerfect() {
+    bool used[64] = {};
+    for (const KeywordEntry& k : kKeywords) {
+        unsigned h = keywordHash(k.text, k.len);
+        if (used[h]) return false;
+        used[h] = true;
+    }
+    return true;
+}
+static_assert(keywordHashIsPerfect(), "keyword hash has collisions");
+
+static constexpr KeywordTable kKeywordTable = makeKeywordTable();
+
 static inline TokenType keywordTypeFast(const sv& w) noexcept {
+    size_t n = w.size();
+    if (n < 2 || n > 8) return TokenType::IDENTIFIER;
+    const KeywordEntry& k = kKeywordTable.slots[keywordHash(w.data(), n)];
+    if (k.len == n && memcmp(k.text, w.data(), n) == 0) return k.type;
+    return TokenType::IDENTIFIER;
+}
+
+// Previous branchy implementation, kept as the baseline for benchmark mode.
+static inline bool isAlnumBranchy(char c) noexcept {
+    return (c == '_') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9');
+}
+
+static inline TokenType keywordTypeSwitch(const sv& w) noexcept {
     if (w.empty()) return TokenType::IDENTIFIER;
     char c = w[0];
     switch (c) {
@@ -209,98 +861,745 @@ static inline TokenType keywordTypeFast(const sv& w) noexcept {
     return TokenType::IDENTIFIER;
 }
 
-// ---------------- Lexer ----------------
-vector<Token> Lexer(const string& Code) {
-    const char* data = Code.data();
-    size_t Len = Code.size();
-    size_t idx = 0;
-    int line = 1;
+// Decodes the text of a NUMBER token (see LuaNumber). Integers and decimal
+// floats go through from_chars; hex floats use its hex format on the digits
+// after "0x". Out-of-range floats fall back to strtod for Lua's inf / 0.
+LuaNumber decodeNumber(const char* p, size_t n) noexcept {
+    const char* end = p + n;
+    bool hex = n >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x';
+    bool isFloat = false;
+    for (size_t k = hex ? 2 : 0; k < n && !isFloat; ++k)
+        isFloat = p[k] == '.' || (p[k] | 0x20) == (hex ? 'p' : 'e');
+
+    if (hex && !isFloat) {
+        if (n == 2) return LuaNumber();
+        uint64_t v = 0;
+        for (size_t k = 2; k < n; ++k) {
+            if (!is_xdigit(p[k])) return LuaNumber();
+            unsigned d = p[k] <= '9' ? p[k] - '0' : (p[k] | 0x20) - 'a' + 10;
+            v = v * 16 + d;  // wraps around, as in Lua
+        }
+        return LuaNumber::integer((int64_t)v);
+    }
+    if (!isFloat) {
+        int64_t v;
+        auto r = from_chars(p, end, v);
+        if (r.ec == errc() && r.ptr == end) return LuaNumber::integer(v);
+        if (r.ec != errc::result_out_of_range) return LuaNumber();
+        // decimal integer overflow: read it as a float instead
+    }
+    double d;
+    auto r = hex ? from_chars(p + 2, end, d, chars_format::hex)
+                 : from_chars(p, end, d);
+    if (r.ptr != end) return LuaNumber();
+    if (r.ec == errc::result_out_of_range)
+        d = strtod(string(p, n).c_str(), nullptr);
+    else if (r.ec != errc()) return LuaNumber();
+    return LuaNumber::real(d);
+}
 
-    vector<Token> tokens;
-    tokens.reserve(min<size_t>(512, max<size_t>(16, Len / 8)));
+// ---------------- Source input ----------------
+// Files are mapped read-only rather than read, so the lexer runs straight
+// over the page cache without a copy; with `sequential`, the kernel is
+// told the bytes will be read front to back, which lets it read further
+// ahead. What can't be mapped (pipes, stdin, empty files, platforms
+// without mmap) is read in large blocks into an 8-byte aligned buffer,
+// sized up front when the size is known.
+class MappedFile {
+   public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
 
-    auto peek = [&](size_t off = 0) -> char {
-        size_t p = idx + off;
-        return (p < Len) ? data[p] : '\0';
-    };
-    auto pushTok = [&](TokenType ttype, size_t start, size_t length) {
-        tokens.push_back(Token{ttype, sv(data + start, length), line});
+    bool open(const filesystem::path& path, bool sequential = false) {
+        close();
+#ifdef LUAP_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        size_t hint = 0;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            hint = size_t(st.st_size);
+            void* p = hint ? mmap(nullptr, hint, PROT_READ, MAP_PRIVATE, fd, 0)
+                           : MAP_FAILED;
+            if (p != MAP_FAILED) {
+                if (sequential) madvise(p, hint, MADV_SEQUENTIAL);
+                map = p;
+                ptr = static_cast<const char*>(p);
+                len = hint;
+                ::close(fd);
+                return true;
+            }
+        }
+        bool ok = readAll(hint, [fd](char* into, size_t n) {
+            return ::read(fd, into, n);
+        });
+        ::close(fd);
+        return ok;
+#else
+        (void)sequential;
+        FILE* f = fopen(path.string().c_str(), "rb");
+        if (!f) return false;
+        error_code ec;
+        uintmax_t size = filesystem::file_size(path, ec);
+        bool ok = readAll(ec ? 0 : size_t(size), [f](char* into, size_t n) {
+            size_t got = fread(into, 1, n, f);
+            return ferror(f) ? ptrdiff_t(-1) : ptrdiff_t(got);
+        });
+        fclose(f);
+        return ok;
+#endif
+    }
+    // all of standard input, up to its end
+    bool openStdin() {
+        close();
+#ifdef LUAP_MMAP
+        return readAll(0, [](char* into, size_t n) {
+            return ::read(0, into, n);
+        });
+#else
+        return readAll(0, [](char* into, size_t n) {
+            size_t got = fread(into, 1, n, stdin);
+            return ferror(stdin) ? ptrdiff_t(-1) : ptrdiff_t(got);
+        });
+#endif
+    }
+    void close() noexcept {
+#ifdef LUAP_MMAP
+        if (map) munmap(map, len);
+#endif
+        map = nullptr;
+        copy.reset();
+        ptr = nullptr;
+        len = 0;
+    }
+
+    const char* data() const noexcept { return ptr; }
+    size_t size() const noexcept { return len; }
+    sv text() const noexcept { return sv(ptr, len); }
+    bool mapped() const noexcept { return map != nullptr; }
+
+   private:
+    // readSome(into, max) returns the bytes read, 0 at the end or < 0 on
+    // error. The buffer starts one byte past `hint` so that a source of
+    // the expected size hits its end without growing.
+    template <class ReadSome>
+    bool readAll(size_t hint, ReadSome&& readSome) {
+        size_t cap = max<size_t>(hint + 1, 64 * 1024);
+        copy.reset(new uint64_t[cap / 8 + 1]);
+        char* buf = reinterpret_cast<char*>(copy.get());
+        for (;;) {
+            if (len == cap) {
+                cap *= 2;
+                unique_ptr<uint64_t[]> grown(new uint64_t[cap / 8 + 1]);
+                memcpy(grown.get(), buf, len);
+                copy = move(grown);
+                buf = reinterpret_cast<char*>(copy.get());
+            }
+            auto got = readSome(buf + len, cap - len);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) {
+                close();
+                return false;
+            }
+            if (got == 0) break;
+            len += size_t(got);
+        }
+        ptr = buf;
+        return true;
+    }
+
+    const char* ptr = nullptr;
+    size_t len = 0;
+    void* map = nullptr;
+    unique_ptr<uint64_t[]> copy;
+};
+
+// ---------------- String literals ----------------
+// kStr* flags of a long-bracket string: its value drops a leading newline
+// and turns every "\r", "\r\n" and "\n\r" into "\n".
+static uint32_t longStringFlags(const char* p, size_t n) noexcept {
+    uint32_t flags = kStrLong;
+    if (n && (p[0] == '\n' || p[0] == '\r' || memchr(p, '\r', n)))
+        flags |= kStrDecode;
+    return flags;
+}
+
+static inline bool isLuaSpace(char c) noexcept {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+static inline unsigned hexValue(char c) noexcept {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+// UTF-8 bytes of `cp` (up to 0x7FFFFFFF, like Lua's \u{...}); returns the
+// end of the written sequence
+static char* utf8Encode(uint32_t cp, char* o) noexcept {
+    if (cp < 0x80) {
+        *o++ = char(cp);
+        return o;
+    }
+    char buf[6];
+    int n = 0;
+    uint32_t mfb = 0x3f;  // largest value that fits the first byte
+    do {
+        buf[5 - n++] = char(0x80 | (cp & 0x3f));
+        cp >>= 6;
+        mfb >>= 1;
+    } while (cp > mfb);
+    buf[5 - n++] = char((~mfb << 1) | cp);
+    return copy(buf + 6 - n, buf + 6, o);
+}
+
+// Decodes the raw bytes of a string literal into `out`, which needs room
+// for raw.size() bytes (decoding never grows a literal). Malformed escapes
+// are kept as written. Returns the decoded length.
+static size_t decodeLuaString(sv raw, bool longForm, char* out) noexcept {
+    const char* p = raw.data();
+    const char* end = p + raw.size();
+    char* o = out;
+    auto skipNewline = [&](const char* q) {  // q at '\n' or '\r'
+        const char* n = q + 1;
+        if (n < end && (*n == '\n' || *n == '\r') && *n != *q) ++n;
+        return n;
     };
 
-    while (idx < Len) {
-        char c = data[idx];
+    if (longForm) {
+        if (p < end && (*p == '\n' || *p == '\r')) p = skipNewline(p);
+        while (p < end) {
+            if (*p == '\n' || *p == '\r') {
+                *o++ = '\n';
+                p = skipNewline(p);
+            } else {
+                *o++ = *p++;
+            }
+        }
+        return size_t(o - out);
+    }
 
-        if (c == '\n') {
-            ++line;
-            ++idx;
+    while (p < end) {
+        if (*p != '\\' || p + 1 == end) {
+            *o++ = *p++;
             continue;
         }
-        if ((unsigned char)c <= 0x20) {
-            ++idx;
-            continue;
-        }  // skip other controls & whitespace quickly
-
+        const char* esc = p;
+        char c = p[1];
+        p += 2;
+        bool ok = true;
         switch (c) {
-            case '(':
-                pushTok(TokenType::LEFT_PAREN, idx, 1);
-                ++idx;
-                continue;
-            case ')':
-                pushTok(TokenType::RIGHT_PAREN, idx, 1);
-                ++idx;
-                continue;
-            case '{':
-                pushTok(TokenType::LEFT_BRACE, idx, 1);
-                ++idx;
-                continue;
-            case '}':
-                pushTok(TokenType::RIGHT_BRACE, idx, 1);
-                ++idx;
-                continue;
-            case '[': {
-                if (peek(1) == '[' || peek(1) == '=') {
-                    size_t check = idx + 1;
-                    int eqs = 0;
-                    while (check < Len && data[check] == '=') {
-                        ++eqs;
-                        ++check;
-                    }
-                    if (check < Len && data[check] == '[') {
-                        bool isComment = (idx >= 2 && data[idx - 2] == '-' &&
-                                          data[idx - 1] == '-');
-                        idx = check + 1;
-                        size_t start = idx;
-                        bool closed = false;
-                        while (idx < Len) {
-                            if (data[idx] == ']') {
-                                size_t closing = idx + 1;
-                                int eqCount = 0;
-                                while (closing < Len && data[closing] == '=') {
-                                    ++eqCount;
-                                    ++closing;
-                                }
-                                if (closing < Len && data[closing] == ']' &&
-                                    eqCount == eqs) {
-                                    if (!isComment)
-                                        pushTok(TokenType::STRING, start,
-                                                idx - start);
-                                    idx = closing + 1;
-                                    closed = true;
-                                    break;
-                                }
-                            }
-                            if (data[idx] == '\n') ++line;
-                            ++idx;
-                        }
-                        if (!closed) {
-                            if (!isComment)
-                                pushTok(TokenType::STRING, start, idx - start);
-                        }
-                        continue;
-                    }
+            case 'a': *o++ = '\a'; break;
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'v': *o++ = '\v'; break;
+            case '\\':
+            case '"':
+            case '\'':
+                *o++ = c;
+                break;
+            case '\n':
+            case '\r':
+                *o++ = '\n';
+                p = skipNewline(p - 1);
+                break;
+            case 'x':
+                ok = end - p >= 2 && is_xdigit(p[0]) && is_xdigit(p[1]);
+                if (ok) {
+                    *o++ = char(hexValue(p[0]) * 16 + hexValue(p[1]));
+                    p += 2;
                 }
-                pushTok(TokenType::LEFT_BRACKET, idx, 1);
-                ++idx;
+                break;
+            case 'z':
+                while (p < end && isLuaSpace(*p)) ++p;
+                break;
+            case 'u': {
+                uint32_t cp = 0;
+                const char* q = p + 1;
+                ok = p < end && *p == '{' && q < end && is_xdigit(*q);
+                while (ok && q < end && is_xdigit(*q)) {
+                    cp = cp * 16 + hexValue(*q++);
+                    ok = cp <= 0x7FFFFFFFu;
+                }
+                ok = ok && q < end && *q == '}';
+                if (ok) {
+                    o = utf8Encode(cp, o);
+                    p = q + 1;
+                }
+                break;
+            }
+            default: {
+                ok = is_digit(c);
+                unsigned v = unsigned(c - '0');
+                for (int k = 0; ok && k < 2 && p < end && is_digit(*p); ++k)
+                    v = v * 10 + unsigned(*p++ - '0');
+                ok = ok && v <= 255;
+                if (ok) *o++ = char(v);
+                break;
+            }
+        }
+        if (!ok) o = copy(esc, p, o);
+    }
+    return size_t(o - out);
+}
+
+sv LuaString::value(Arena& arena) const {
+    if (zeroCopy()) return raw;
+    char* out = arena.alloc(raw.size());
+    return sv(out, decodeLuaString(raw, flags & kStrLong, out));
+}
+
+// Tokens in a vector<Token> carry no flags; they are worked out from the
+// text (the byte before it tells quotes from long brackets).
+LuaString TokenVectorView::str(size_t i) const noexcept {
+    sv t = tokens[i].text;
+    char open = t.data()[-1];
+    if (open == '[' || open == '=')
+        return LuaString{t, longStringFlags(t.data(), t.size())};
+    uint32_t flags = 0;
+    if (t.find('\\') != sv::npos) flags |= kStrDecode;
+    return LuaString{t, flags};
+}
+
+// ---------------- SIMD scanning ----------------
+// The lexer's byte loops (whitespace, identifier tails, quoted strings, line
+// comments, long brackets) and the newline index are all "find the next
+// interesting byte" scans.
+// Each kernel set below implements them; the lexer is instantiated once per
+// set and the widest one the CPU supports is chosen at runtime.
+
+enum class ScanLevel { Scalar, SSE2, AVX2 };
+
+static inline const char* scanLevelName(ScanLevel l) noexcept {
+    switch (l) {
+        case ScanLevel::AVX2:
+            return "AVX2";
+        case ScanLevel::SSE2:
+            return "SSE2";
+        default:
+            return "scalar";
+    }
+}
+
+static inline unsigned ctz32(uint32_t m) noexcept {
+#ifdef _MSC_VER
+    unsigned long r;
+    _BitScanForward(&r, m);
+    return (unsigned)r;
+#else
+    return (unsigned)__builtin_ctz(m);
+#endif
+}
+
+static inline unsigned popcount32(uint32_t m) noexcept {
+#ifdef _MSC_VER
+    return (unsigned)__popcnt(m);
+#else
+    return (unsigned)__builtin_popcount(m);
+#endif
+}
+
+struct ScalarScan {
+    // first byte that is not whitespace / a control character
+    static inline size_t space(const char* d, size_t i, size_t n) noexcept {
+        while (i < n && (unsigned char)d[i] <= 0x20) ++i;
+        return i;
+    }
+    static inline size_t ident(const char* d, size_t i, size_t n) noexcept {
+        while (i < n && is_alnum(d[i])) ++i;
+        return i;
+    }
+    static inline size_t find1(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        while (i < n && d[i] != a) ++i;
+        return i;
+    }
+    static inline size_t find2(const char* d, size_t i, size_t n, char a,
+                               char b) noexcept {
+        while (i < n && d[i] != a && d[i] != b) ++i;
+        return i;
+    }
+    static inline size_t count(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        size_t c = 0;
+        for (; i < n; ++i) c += d[i] == a;
+        return c;
+    }
+    // first byte a JSON string has to escape: '"', '\\' or a control byte
+    static inline size_t jsonPlain(const char* d, size_t i,
+                                   size_t n) noexcept {
+        while (i < n && (unsigned char)d[i] >= 0x20 && d[i] != '"' &&
+               d[i] != '\\')
+            ++i;
+        return i;
+    }
+};
+
+#ifdef LUAP_X86
+#ifdef _MSC_VER
+#define LUAP_TARGET_AVX2
+#else
+#define LUAP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct Sse2Scan {
+    // byte-wise unsigned "lo <= v <= hi"
+    static inline __m128i inRange(__m128i v, char lo, char hi) noexcept {
+        __m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+        return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(char(hi - lo))),
+                              t);
+    }
+    static inline size_t space(const char* d, size_t i, size_t n) noexcept {
+        const __m128i ctl = _mm_set1_epi8(0x20);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            __m128i skip = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+            uint32_t m = ~(uint32_t)_mm_movemask_epi8(skip) & 0xFFFFu;
+            if (m) return i + ctz32(m);
+        }
+        return ScalarScan::space(d, i, n);
+    }
+    static inline size_t ident(const char* d, size_t i, size_t n) noexcept {
+        const __m128i lc = _mm_set1_epi8(0x20), us = _mm_set1_epi8('_');
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            __m128i ok = _mm_or_si128(
+                _mm_or_si128(inRange(_mm_or_si128(v, lc), 'a', 'z'),
+                             inRange(v, '0', '9')),
+                _mm_cmpeq_epi8(v, us));
+            uint32_t m = ~(uint32_t)_mm_movemask_epi8(ok) & 0xFFFFu;
+            if (m) return i + ctz32(m);
+        }
+        return ScalarScan::ident(d, i, n);
+    }
+    static inline size_t find1(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        const __m128i va = _mm_set1_epi8(a);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, va));
+            if (m) return i + ctz32(m);
+        }
+        return ScalarScan::find1(d, i, n, a);
+    }
+    static inline size_t find2(const char* d, size_t i, size_t n, char a,
+                               char b) noexcept {
+        const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            uint32_t m = (uint32_t)_mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+            if (m) return i + ctz32(m);
+        }
+        return ScalarScan::find2(d, i, n, a, b);
+    }
+    static inline size_t count(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        const __m128i va = _mm_set1_epi8(a);
+        size_t c = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            c += popcount32((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, va)));
+        }
+        return c + ScalarScan::count(d, i, n, a);
+    }
+    static inline size_t jsonPlain(const char* d, size_t i,
+                                   size_t n) noexcept {
+        const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+        const __m128i ctl = _mm_set1_epi8(0x1F);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+            __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs)),
+                _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+            uint32_t m = (uint32_t)_mm_movemask_epi8(hit);
+            if (m) return i + ctz32(m);
+        }
+        return ScalarScan::jsonPlain(d, i, n);
+    }
+};
+
+// 32-byte loops, kept out of line so only they are compiled for AVX2.
+LUAP_TARGET_AVX2 static size_t avx2Space(const char* d, size_t i,
+                                         size_t n) noexcept {
+    const __m256i ctl = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(d + i));
+        __m256i skip = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v);
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(skip);
+        if (m) return i + ctz32(m);
+    }
+    return Sse2Scan::space(d, i, n);
+}
+LUAP_TARGET_AVX2 static size_t avx2Ident(const char* d, size_t i,
+                                         size_t n) noexcept {
+    const __m256i lc = _mm256_set1_epi8(0x20), us = _mm256_set1_epi8('_');
+    const __m256i a = _mm256_set1_epi8('a'), z = _mm256_set1_epi8('z' - 'a');
+    const __m256i d0 = _mm256_set1_epi8('0'), d9 = _mm256_set1_epi8(9);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(d + i));
+        __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, lc), a);
+        __m256i g = _mm256_sub_epi8(v, d0);
+        __m256i ok = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(l, z), l),
+                            _mm256_cmpeq_epi8(_mm256_min_epu8(g, d9), g)),
+            _mm256_cmpeq_epi8(v, us));
+        uint32_t m = ~(uint32_t)_mm256_movemask_epi8(ok);
+        if (m) return i + ctz32(m);
+    }
+    return Sse2Scan::ident(d, i, n);
+}
+LUAP_TARGET_AVX2 static size_t avx2Find2(const char* d, size_t i, size_t n,
+                                         char a, char b) noexcept {
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(d + i));
+        __m256i hit =
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(hit);
+        if (m) return i + ctz32(m);
+    }
+    return Sse2Scan::find2(d, i, n, a, b);
+}
+LUAP_TARGET_AVX2 static size_t avx2Count(const char* d, size_t i, size_t n,
+                                         char a) noexcept {
+    const __m256i va = _mm256_set1_epi8(a);
+    size_t c = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(d + i));
+        c += popcount32(
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, va)));
+    }
+    return c + Sse2Scan::count(d, i, n, a);
+}
+
+// Most runs are short (identifiers, indentation), so the first 16 bytes are
+// checked inline with SSE2 and only longer runs pay for the AVX2 call.
+struct Avx2Scan {
+    static inline size_t space(const char* d, size_t i, size_t n) noexcept {
+        if (i + 16 <= n) {
+            size_t r = Sse2Scan::space(d, i, i + 16);
+            if (r < i + 16) return r;
+            return avx2Space(d, i + 16, n);
+        }
+        return ScalarScan::space(d, i, n);
+    }
+    static inline size_t ident(const char* d, size_t i, size_t n) noexcept {
+        if (i + 16 <= n) {
+            size_t r = Sse2Scan::ident(d, i, i + 16);
+            if (r < i + 16) return r;
+            return avx2Ident(d, i + 16, n);
+        }
+        return ScalarScan::ident(d, i, n);
+    }
+    static inline size_t find1(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        return find2(d, i, n, a, a);
+    }
+    static inline size_t find2(const char* d, size_t i, size_t n, char a,
+                               char b) noexcept {
+        if (i + 16 <= n) {
+            size_t r = Sse2Scan::find2(d, i, i + 16, a, b);
+            if (r < i + 16) return r;
+            return avx2Find2(d, i + 16, n, a, b);
+        }
+        return ScalarScan::find2(d, i, n, a, b);
+    }
+    static inline size_t count(const char* d, size_t i, size_t n,
+                               char a) noexcept {
+        return avx2Count(d, i, n, a);
+    }
+};
+#endif  // LUAP_X86
+
+static ScanLevel detectScanLevel() noexcept {
+#ifdef LUAP_X86
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] >= 7) {
+        __cpuid(r, 1);
+        bool osxsave = (r[2] & (1 << 27)) != 0;
+        bool avx = (r[2] & (1 << 28)) != 0;
+        __cpuidex(r, 7, 0);
+        bool avx2 = (r[1] & (1 << 5)) != 0;
+        if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6)
+            return ScanLevel::AVX2;
+    }
+#else
+    if (__builtin_cpu_supports("avx2")) return ScanLevel::AVX2;
+#endif
+    return ScanLevel::SSE2;
+#else
+    return ScanLevel::Scalar;
+#endif
+}
+
+// Widest kernel set usable on this CPU (detected once).
+static inline ScanLevel bestScanLevel() noexcept {
+    static const ScanLevel level = detectScanLevel();
+    return level;
+}
+
+template <class Scan>
+static void buildLineStarts(const char* d, size_t n, vector<uint32_t>& starts) {
+    starts.reserve(Scan::count(d, 0, n, '\n') + 1);
+    for (size_t i = Scan::find1(d, 0, n, '\n'); i < n;
+         i = Scan::find1(d, i + 1, n, '\n'))
+        starts.push_back((uint32_t)(i + 1));
+}
+
+LineIndex::LineIndex(const char* data, size_t len) {
+    switch (bestScanLevel()) {
+#ifdef LUAP_X86
+        case ScanLevel::AVX2:
+            buildLineStarts<Avx2Scan>(data, len, starts);
+            break;
+        case ScanLevel::SSE2:
+            buildLineStarts<Sse2Scan>(data, len, starts);
+            break;
+#endif
+        default:
+            buildLineStarts<ScalarScan>(data, len, starts);
+    }
+}
+
+// ---------------- Lexer ----------------
+// Core scanning loop. Lexes from `idx`, handing tokens to `sink.push()`,
+// until a token would start at or after `end` or `sink.full()` asks to
+// pause; returns the position to resume from. Tokens that start before
+// `end` may run past it (up to Len). The END_OF_FILE token is left to the
+// caller.
+template <class Scan, class Sink>
+static size_t lexLoop(const char* data, size_t Len, size_t idx, size_t end,
+                      Sink& sink) {
+    auto peek = [&](size_t off = 0) -> char {
+        size_t p = idx + off;
+        return (p < Len) ? data[p] : '\0';
+    };
+    auto pushTok = [&](TokenType ttype, size_t start, size_t length) {
+        sink.push(ttype, start, length);
+    };
+
+    while (idx < end && !sink.full()) {
+        char c = data[idx];
+        uint8_t cls = charClass(c);
+
+        if (cls & CC_SPACE) {
+            idx = Scan::space(data, idx + 1, Len);
+            continue;
+        }  // skip other controls & whitespace quickly
+
+        // identifiers / keywords
+        if (cls & CC_ALPHA) {
+            size_t start = idx;
+            idx = Scan::ident(data, idx + 1, Len);
+            sv word(data + start, idx - start);
+            TokenType k = keywordTypeFast(word);
+            if (k == TokenType::IDENTIFIER)
+                sink.pushName(start, idx - start);
+            else
+                pushTok(k, start, idx - start);
+            continue;
+        }
+
+        // numbers ('.5' never gets here: '.' is punctuation below)
+        if (cls & CC_DIGIT) {
+            size_t start = idx;
+            if (c == '0' && (peek(1) == 'x' || peek(1) == 'X')) {
+                idx += 2;
+                while (idx < Len &&
+                       (is_xdigit(data[idx]) || data[idx] == '.'))
+                    ++idx;
+                if (idx < Len && (data[idx] == 'p' || data[idx] == 'P')) {
+                    ++idx;
+                    if (peek() == '+' || peek() == '-') ++idx;
+                    while (idx < Len && is_digit(data[idx])) ++idx;
+                }
+            } else {
+                while (idx < Len && is_digit(data[idx])) ++idx;
+                if (peek() == '.') {
+                    ++idx;
+                    while (idx < Len && is_digit(data[idx])) ++idx;
+                }
+                if (peek() == 'e' || peek() == 'E') {
+                    ++idx;
+                    if (peek() == '+' || peek() == '-') ++idx;
+                    while (idx < Len && is_digit(data[idx])) ++idx;
+                }
+            }
+            sink.pushNumber(start, idx - start,
+                            decodeNumber(data + start, idx - start));
+            continue;
+        }
+
+        // punctuation / operators
+        switch (c) {
+            case '(':
+                pushTok(TokenType::LEFT_PAREN, idx, 1);
+                ++idx;
+                continue;
+            case ')':
+                pushTok(TokenType::RIGHT_PAREN, idx, 1);
+                ++idx;
+                continue;
+            case '{':
+                pushTok(TokenType::LEFT_BRACE, idx, 1);
+                ++idx;
+                continue;
+            case '}':
+                pushTok(TokenType::RIGHT_BRACE, idx, 1);
+                ++idx;
+                continue;
+            case '[': {
+                if (peek(1) == '[' || peek(1) == '=') {
+                    size_t check = idx + 1;
+                    int eqs = 0;
+                    while (check < Len && data[check] == '=') {
+                        ++eqs;
+                        ++check;
+                    }
+                    if (check < Len && data[check] == '[') {
+                        bool isComment = (idx >= 2 && data[idx - 2] == '-' &&
+                                          data[idx - 1] == '-');
+                        idx = check + 1;
+                        size_t start = idx;
+                        bool closed = false;
+                        while ((idx = Scan::find1(data, idx, Len, ']')) <
+                               Len) {
+                            size_t closing = idx + 1;
+                            int eqCount = 0;
+                            while (closing < Len && data[closing] == '=') {
+                                ++eqCount;
+                                ++closing;
+                            }
+                            if (closing < Len && data[closing] == ']' &&
+                                eqCount == eqs) {
+                                if (!isComment)
+                                    sink.push(TokenType::STRING, start,
+                                              idx - start,
+                                              longStringFlags(data + start,
+                                                              idx - start));
+                                idx = closing + 1;
+                                closed = true;
+                                break;
+                            }
+                            ++idx;
+                        }
+                        if (!closed) {
+                            if (!isComment)
+                                sink.push(TokenType::STRING, start,
+                                          idx - start,
+                                          longStringFlags(data + start,
+                                                          idx - start));
+                        }
+                        continue;
+                    }
+                }
+                pushTok(TokenType::LEFT_BRACKET, idx, 1);
+                ++idx;
                 continue;
             }
             case ']':
@@ -360,7 +1659,7 @@ vector<Token> Lexer(const string& Code) {
                 if (peek(1) == '-') {
                     idx += 2;
                     if (peek() == '[') continue;
-                    while (idx < Len && data[idx] != '\n') ++idx;
+                    idx = Scan::find1(data, idx, Len, '\n');
                     continue;
                 }
                 pushTok(TokenType::MINUS, idx, 1);
@@ -383,8 +1682,8 @@ vector<Token> Lexer(const string& Code) {
                     idx += 2;
                 } else {
                     ++idx;
-                    continue;
                 }
+                continue;
             }
             case '<': {
                 if (peek(1) == '=') {
@@ -410,16 +1709,17 @@ vector<Token> Lexer(const string& Code) {
             case '\'': {
                 char q = c;
                 size_t start = idx + 1;
+                uint32_t flags = 0;
                 ++idx;
-                while (idx < Len && data[idx] != q) {
-                    if (data[idx] == '\n') ++line;
-                    if (data[idx] == '\\' && idx + 1 < Len)
+                while ((idx = Scan::find2(data, idx, Len, q, '\\')) < Len &&
+                       data[idx] != q) {
+                    flags = kStrDecode;  // stopped on a backslash
+                    if (idx + 1 < Len)
                         idx += 2;
                     else
                         ++idx;
                 }
-                pushTok(TokenType::STRING, start,
-                        (idx < Len ? idx - start : idx - start));
+                sink.push(TokenType::STRING, start, idx - start, flags);
                 if (idx < Len && data[idx] == q) ++idx;
                 continue;
             }
@@ -427,812 +1727,4486 @@ vector<Token> Lexer(const string& Code) {
                 break;
         }
 
-        // numbers
-        if (is_digit(c) || (c == '.' && is_digit(peek(1)))) {
-            size_t start = idx;
-            if (c == '0' && (peek(1) == 'x' || peek(1) == 'X')) {
-                idx += 2;
-                while (idx < Len &&
-                       (isxdigit((unsigned char)data[idx]) || data[idx] == '.'))
-                    ++idx;
-                if (idx < Len && (data[idx] == 'p' || data[idx] == 'P')) {
-                    ++idx;
-                    if (peek() == '+' || peek() == '-') ++idx;
-                    while (idx < Len && is_digit(data[idx])) ++idx;
-                }
-            } else {
-                while (idx < Len && is_digit(data[idx])) ++idx;
-                if (peek() == '.') {
-                    ++idx;
-                    while (idx < Len && is_digit(data[idx])) ++idx;
-                }
-                if (peek() == 'e' || peek() == 'E') {
-                    ++idx;
-                    if (peek() == '+' || peek() == '-') ++idx;
-                    while (idx < Len && is_digit(data[idx])) ++idx;
-                }
-            }
-            pushTok(TokenType::NUMBER, start, idx - start);
-            continue;
-        }
-
-        // identifiers / keywords
-        if (is_alpha(c)) {
-            size_t start = idx;
-            ++idx;
-            while (idx < Len && is_alnum(data[idx])) ++idx;
-            sv word(data + start, idx - start);
-            TokenType k = keywordTypeFast(word);
-            pushTok(k, start, idx - start);
-            continue;
-        }
-
         // fallback: skip unknown
         ++idx;
     }
+    return idx;
+}
+
+struct TokenStreamSink {
+    TokenStream& tokens;
+    SymbolTable& symbols;
+
+    void push(TokenType t, size_t start, size_t length, uint32_t aux = 0) {
+        tokens.push(t, start, length, aux);
+    }
+    void pushNumber(size_t start, size_t length, LuaNumber v) {
+        tokens.pushNumber(start, length, v);
+    }
+    void pushName(size_t start, size_t length) {
+        tokens.push(TokenType::IDENTIFIER, start, length,
+                    symbols.intern(sv(tokens.base + start, length)));
+    }
+    static constexpr bool full() noexcept { return false; }
+};
 
-    tokens.push_back(Token{TokenType::END_OF_FILE, sv(), line});
+template <class Scan>
+static TokenStream lexWith(sv Code, SymbolTable& symbols) {
+    const char* data = Code.data();
+    size_t Len = Code.size();
+
+    TokenStream tokens;
+    tokens.base = data;
+    tokens.symbols = &symbols;
+    tokens.reserve(Len / 6 + 16);
+    TokenStreamSink sink{tokens, symbols};
+    lexLoop<Scan>(data, Len, 0, Len, sink);
+
+    tokens.push(TokenType::END_OF_FILE, Len, 0);
+    tokens.lines = LineIndex(data, Len);
     return tokens;
 }
 
-// ---------------- Parser ----------------
-
-static inline int precedenceOf(const Token& t) noexcept {
-    switch (t.type) {
-        case TokenType::OR:
-            return 1;
-        case TokenType::AND:
-            return 2;
-        case TokenType::LESS:
-        case TokenType::LESS_EQUAL:
-        case TokenType::GREATER:
-        case TokenType::GREATER_EQUAL:
-        case TokenType::EQUAL_EQUAL:
-        case TokenType::BANG_EQUAL:
-            return 3;
-        case TokenType::DOT_DOT:
-            return 4;
-        case TokenType::PLUS:
-        case TokenType::MINUS:
-            return 5;
-        case TokenType::STAR:
-        case TokenType::SLASH:
-        case TokenType::PERCENT:
-            return 6;
-        case TokenType::CARET:
-            return 8;
+// Lex with an explicit kernel set (clamped to what the CPU supports),
+// interning identifiers into `symbols`.
+TokenStream LexStream(sv Code, ScanLevel level,
+                      SymbolTable& symbols = globalSymbols()) {
+    if (level > bestScanLevel()) level = bestScanLevel();
+    switch (level) {
+#ifdef LUAP_X86
+        case ScanLevel::AVX2:
+            return lexWith<Avx2Scan>(Code, symbols);
+        case ScanLevel::SSE2:
+            return lexWith<Sse2Scan>(Code, symbols);
+#endif
         default:
-            return 0;
+            return lexWith<ScalarScan>(Code, symbols);
     }
 }
-static inline bool isRightAssociative(const Token& t) noexcept {
-    return t.type == TokenType::CARET || t.type == TokenType::DOT_DOT;
+
+TokenStream LexStream(sv Code) {
+    return LexStream(Code, bestScanLevel());
 }
 
-// forward
-AST parseExpressionForwardDecl(const vector<Token>& Tokens, int& Index);
+// Array-of-structs compatibility API.
+vector<Token> Lexer(sv Code) { return LexStream(Code).toVector(); }
 
-inline AST makeLeaf(ASTType t, const sv& txt, int line) {
-    AST a;
-    a.type = t;
-    a.text.assign(txt.begin(),
-                  txt.end());  // convert string_view to string once
-    a.line = line;
-    a.children.clear();
-    return a;
+// ---------------- Parallel lexing ----------------
+// Runs fn(0) .. fn(n - 1) on n threads (the caller takes the last one).
+template <class Fn>
+static void parallelFor(size_t n, Fn&& fn) {
+    vector<thread> workers;
+    workers.reserve(n ? n - 1 : 0);
+    for (size_t i = 0; i + 1 < n; ++i)
+        workers.emplace_back([&fn, i] { fn(i); });
+    if (n) fn(n - 1);
+    for (thread& t : workers) t.join();
 }
 
-AST parsePrimary(const vector<Token>& Tokens, int& Index) {
-    if ((size_t)Index >= Tokens.size())
-        return makeLeaf(ASTType::Identifier, "<?>", 0);
-    const Token& tk = Tokens[Index];
+// Runs fn(0) .. fn(n - 1) on up to `threads` threads (the caller is one of
+// them), each claiming the next index as soon as it is free, so uneven
+// items balance out.
+template <class Fn>
+static void parallelForDynamic(size_t n, unsigned threads, Fn&& fn) {
+    atomic<size_t> next{0};
+    parallelFor(min<size_t>(max(1u, threads), n), [&](size_t) {
+        for (size_t i; (i = next.fetch_add(1)) < n;) fn(i);
+    });
+}
+
+// The source is cut into one chunk per thread (at line starts where
+// possible) and every chunk is lexed concurrently on the speculation that it
+// begins in plain code. A cut can land inside a token, string or comment, so
+// the chunks are stitched in order afterwards: chunk i really resumes where
+// chunk i-1 stopped. If that is where its speculative run began, all of its
+// tokens stand. Otherwise it is re-lexed from the true position until that
+// run emits a non-string token with the same offset, type and length as a
+// speculative one. Both runs were then at the top of the lexer loop at the
+// same byte, and since that position is the lexer's entire state, everything
+// after it is reused.
+struct LexChunk {
+    size_t begin = 0, end = 0, exit = 0;
+    TokenStream spec;            // speculative tokens, lexed from `begin`
+    TokenStream fixed;           // tokens re-lexed while stitching
+    size_t reuseFrom = 0;        // first speculative token kept
+    size_t numbersFrom = 0;      // first speculative number kept
+    vector<uint32_t> lineStarts;  // newline + 1 positions inside the chunk
+    SymbolTable symbols;          // chunk-private; ids remapped on merge
+    vector<uint32_t> firstUses;   // chunk symbol ids, as first kept
+    uint64_t uses = 0;            // IDENTIFIER tokens kept
+    vector<uint32_t> symbolIds;   // chunk symbol id -> merged table id
+};
+
+// lexLoop sink for stitching: stops once it reproduces a speculative token
+struct ResyncSink {
+    TokenStream& out;
+    const TokenStream& spec;
+    SymbolTable& symbols;
+    size_t j = 0;  // first speculative token not yet matched or passed
+    bool synced = false;
+
+    void push(TokenType t, size_t start, size_t length, uint32_t aux = 0) {
+        if (synced) return;  // same-iteration token; the reused tail has it
+        out.push(t, start, length, aux);
+        match(t, start, length);
+    }
+    void pushNumber(size_t start, size_t length, LuaNumber v) {
+        if (synced) return;
+        out.pushNumber(start, length, v);
+        match(TokenType::NUMBER, start, length);
+    }
+    void pushName(size_t start, size_t length) {
+        if (synced) return;
+        out.push(TokenType::IDENTIFIER, start, length,
+                 symbols.intern(sv(out.base + start, length)));
+        match(TokenType::IDENTIFIER, start, length);
+    }
+    void match(TokenType t, size_t start, size_t length) {
+        if (t == TokenType::STRING) return;  // offset isn't a loop position
+        while (j < spec.size() && spec.offsets[j] < start) ++j;
+        if (j < spec.size() && spec.offsets[j] == start &&
+            spec.types[j] == t && spec.lengths[j] == length) {
+            synced = true;
+            ++j;
+        }
+    }
+    bool full() const noexcept { return synced; }
+};
+
+template <class Scan>
+static TokenStream lexParallelWith(sv Code, size_t nChunks,
+                                   SymbolTable& symbols) {
+    const char* data = Code.data();
+    size_t Len = Code.size();
+
+    vector<LexChunk> chunks(nChunks);
+    size_t prev = 0;
+    for (size_t i = 0; i < nChunks; ++i) {
+        size_t b = i == 0 ? 0 : Len * i / nChunks;
+        if (i > 0) {
+            size_t lim = Len * (i + 1) / nChunks;
+            size_t nl = Scan::find1(data, b, lim, '\n');
+            if (nl < lim) b = nl + 1;
+        }
+        chunks[i].begin = max(b, prev);
+        if (i > 0) chunks[i - 1].end = chunks[i].begin;
+        prev = chunks[i].begin;
+    }
+    chunks.back().end = Len;
+
+    parallelFor(nChunks, [&](size_t i) {
+        LexChunk& c = chunks[i];
+        c.spec.base = c.fixed.base = data;
+        c.spec.reserve((c.end - c.begin) / 6 + 16);
+        TokenStreamSink sink{c.spec, c.symbols};
+        c.exit = lexLoop<Scan>(data, Len, c.begin, c.end, sink);
+        for (size_t k = Scan::find1(data, c.begin, c.end, '\n'); k < c.end;
+             k = Scan::find1(data, k + 1, c.end, '\n'))
+            c.lineStarts.push_back((uint32_t)(k + 1));
+    });
+
+    // stitch in order
+    size_t pos = 0;
+    for (LexChunk& c : chunks) {
+        if (pos >= c.end) {  // swallowed by the previous chunk's last token
+            c.reuseFrom = c.spec.size();
+        } else if (pos == c.begin) {
+            c.reuseFrom = 0;
+            pos = c.exit;
+        } else {
+            ResyncSink sink{c.fixed, c.spec, c.symbols};
+            size_t stop = lexLoop<Scan>(data, Len, pos, c.end, sink);
+            c.reuseFrom = sink.synced ? sink.j : c.spec.size();
+            pos = sink.synced ? c.exit : stop;
+        }
+    }
+
+    // numbers are stored in token order, so the kept ones are a suffix;
+    // names that only dropped tokens use are never interned
+    parallelFor(nChunks, [&](size_t i) {
+        LexChunk& c = chunks[i];
+        c.numbersFrom = c.spec.numbers.size();
+        for (size_t k = c.reuseFrom; k < c.spec.size(); ++k)
+            if (c.spec.types[k] == TokenType::NUMBER) {
+                c.numbersFrom = c.spec.aux[k];
+                break;
+            }
+        vector<char> seen(c.symbols.size());
+        auto scan = [&](const TokenStream& from, size_t b) {
+            for (size_t k = b; k < from.size(); ++k) {
+                if (from.types[k] != TokenType::IDENTIFIER) continue;
+                ++c.uses;
+                if (!seen[from.aux[k]]) {
+                    seen[from.aux[k]] = 1;
+                    c.firstUses.push_back(from.aux[k]);
+                }
+            }
+        };
+        scan(c.fixed, 0);
+        scan(c.spec, c.reuseFrom);
+    });
+    // in token order, so ids come out as the sequential lexer gives them
+    for (LexChunk& c : chunks)
+        c.symbolIds = symbols.absorb(c.symbols, c.firstUses, c.uses);
+
+    // concatenate
+    vector<size_t> tokAt(nChunks + 1, 0), lineAt(nChunks + 1, 1),
+        numAt(nChunks + 1, 0);
+    for (size_t i = 0; i < nChunks; ++i) {
+        const LexChunk& c = chunks[i];
+        tokAt[i + 1] = tokAt[i] + c.fixed.size() + c.spec.size() - c.reuseFrom;
+        lineAt[i + 1] = lineAt[i] + c.lineStarts.size();
+        numAt[i + 1] = numAt[i] + c.fixed.numbers.size() +
+                       c.spec.numbers.size() - c.numbersFrom;
+    }
+    size_t total = tokAt[nChunks] + 1;
+    TokenStream tokens;
+    tokens.base = data;
+    tokens.symbols = &symbols;
+    tokens.types.resize(total);
+    tokens.offsets.resize(total);
+    tokens.lengths.resize(total);
+    tokens.aux.resize(total);
+    tokens.numbers.resize(numAt[nChunks]);
+    vector<uint32_t> starts(lineAt[nChunks]);
+    starts[0] = 0;
+    parallelFor(nChunks, [&](size_t i) {
+        const LexChunk& c = chunks[i];
+        size_t at = tokAt[i], num = numAt[i];
+        auto append = [&](const TokenStream& from, size_t b, size_t nb) {
+            size_t e = from.size();
+            copy_n(from.types.begin() + b, e - b, tokens.types.begin() + at);
+            copy_n(from.offsets.begin() + b, e - b,
+                   tokens.offsets.begin() + at);
+            copy_n(from.lengths.begin() + b, e - b,
+                   tokens.lengths.begin() + at);
+            for (size_t k = b; k < e; ++k, ++at) {
+                uint32_t a = from.aux[k];
+                if (from.types[k] == TokenType::NUMBER)
+                    a = uint32_t(a - nb + num);
+                else if (from.types[k] == TokenType::IDENTIFIER)
+                    a = c.symbolIds[a];
+                tokens.aux[at] = a;
+            }
+            copy(from.numbers.begin() + nb, from.numbers.end(),
+                 tokens.numbers.begin() + num);
+            num += from.numbers.size() - nb;
+        };
+        append(c.fixed, 0, 0);
+        append(c.spec, c.reuseFrom, c.numbersFrom);
+        copy_n(c.lineStarts.begin(), c.lineStarts.size(),
+               starts.begin() + lineAt[i]);
+    });
+    size_t last = total - 1;
+    tokens.types[last] = TokenType::END_OF_FILE;
+    tokens.offsets[last] = (uint32_t)Len;
+    tokens.lengths[last] = 0;
+    tokens.aux[last] = 0;
+    tokens.lines = LineIndex::fromStarts(move(starts));
+    return tokens;
+}
+
+// Parallel LexStream(): same tokens, lexed on `threads` threads (0 = all
+// cores). Inputs too small to give every thread `minChunkBytes` use fewer
+// threads, down to the plain sequential lexer.
+TokenStream LexStreamParallel(sv Code, unsigned threads = 0,
+                              size_t minChunkBytes = 256 * 1024,
+                              SymbolTable& symbols = globalSymbols()) {
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    size_t nChunks =
+        min<size_t>(threads, Code.size() / max<size_t>(1, minChunkBytes));
+    if (nChunks <= 1) return LexStream(Code, bestScanLevel(), symbols);
+    switch (bestScanLevel()) {
+#ifdef LUAP_X86
+        case ScanLevel::AVX2:
+            return lexParallelWith<Avx2Scan>(Code, nChunks, symbols);
+        case ScanLevel::SSE2:
+            return lexParallelWith<Sse2Scan>(Code, nChunks, symbols);
+#endif
+        default:
+            return lexParallelWith<ScalarScan>(Code, nChunks, symbols);
+    }
+}
+
+// Index the parser jumps to when it gives up: past any token stream, so
+// every statement loop ends without further checks.
+static constexpr int kStopIndex = INT32_MAX / 2;
+
+// Pull-based token source. Tokens are lexed on demand into a small ring
+// buffer, so token memory stays constant however large the source is. It
+// offers the same accessors as TokenStream, but only the most recent
+// kWindow tokens stay addressable; the parser never looks further back than
+// Index and Index + 1.
+class StreamingLexer {
+   public:
+    static constexpr size_t kWindow = 8;  // power of two
+
+    explicit StreamingLexer(sv Code,
+                            ScanLevel level = bestScanLevel(),
+                            SymbolTable& symbols = globalSymbols())
+        : StreamingLexer(Code, level, &symbols) {}
+    // With no table, names are not interned and symbol() is kNoSymbol; for
+    // Validate(), which never asks.
+    StreamingLexer(sv Code, ScanLevel level, SymbolTable* symbols);
+
+    const char* base() const noexcept { return data; }
+    // makes token i available; false once the stream ended before it.
+    // kStopIndex is never lexed up to: the parser has given up.
+    bool has(size_t i) {
+        if (i >= size_t(kStopIndex)) return false;
+        while (i >= produced && !done) pull();
+        return i < produced;
+    }
+    TokenType type(size_t i) const noexcept { return slot(i).type; }
+    sv text(size_t i) const noexcept {
+        const Slot& s = slot(i);
+        return sv(data + s.offset, s.length);
+    }
+    uint32_t offset(size_t i) const noexcept { return slot(i).offset; }
+    LuaNumber number(size_t i) const noexcept { return slot(i).number; }
+    LuaString str(size_t i) const noexcept {
+        const Slot& s = slot(i);
+        return LuaString{sv(data + s.offset, s.length), s.aux};
+    }
+    uint32_t symbol(size_t i) const noexcept { return slot(i).aux; }
+    Token operator[](size_t i) const noexcept {
+        const Slot& s = slot(i);
+        return Token{s.type, sv(data + s.offset, s.length), s.offset};
+    }
+
+   private:
+    struct Slot {
+        TokenType type;
+        uint32_t offset;
+        uint32_t length;
+        uint32_t aux;      // STRING flags / IDENTIFIER symbol id
+        LuaNumber number;  // NUMBER tokens only
+    };
+    // lexLoop sink: appends to the ring and pauses after the first token
+    struct RingSink {
+        StreamingLexer& lx;
+        size_t mark;
+
+        void push(TokenType t, size_t start, size_t length,
+                  uint32_t aux = 0) {
+            lx.ring[lx.produced++ & (kWindow - 1)] =
+                Slot{t, (uint32_t)start, (uint32_t)length, aux, LuaNumber()};
+        }
+        void pushNumber(size_t start, size_t length, LuaNumber v) {
+            lx.ring[lx.produced++ & (kWindow - 1)] = Slot{
+                TokenType::NUMBER, (uint32_t)start, (uint32_t)length, 0, v};
+        }
+        void pushName(size_t start, size_t length) {
+            push(TokenType::IDENTIFIER, start, length,
+                 lx.symbols ? lx.symbols->intern(sv(lx.data + start, length))
+                            : kNoSymbol);
+        }
+        bool full() const noexcept { return lx.produced != mark; }
+    };
+    using StepFn = size_t (*)(const char*, size_t, size_t, RingSink&);
+
+    template <class Scan>
+    static size_t step(const char* d, size_t n, size_t idx, RingSink& sink) {
+        return lexLoop<Scan>(d, n, idx, n, sink);
+    }
+
+    const Slot& slot(size_t i) const noexcept {
+        assert(i < produced && i + kWindow >= produced);
+        return ring[i & (kWindow - 1)];
+    }
+    void pull() {
+        RingSink sink{*this, produced};
+        idx = stepFn(data, Len, idx, sink);
+        if (!sink.full()) {
+            sink.push(TokenType::END_OF_FILE, Len, 0);
+            done = true;
+        }
+    }
+
+    const char* data;
+    size_t Len;
+    SymbolTable* symbols;
+    size_t idx = 0;
+    size_t produced = 0;
+    bool done = false;
+    StepFn stepFn;
+    Slot ring[kWindow];
+};
+
+StreamingLexer::StreamingLexer(sv Code, ScanLevel level,
+                               SymbolTable* symbols)
+    : data(Code.data()), Len(Code.size()), symbols(symbols) {
+    if (level > bestScanLevel()) level = bestScanLevel();
+    switch (level) {
+#ifdef LUAP_X86
+        case ScanLevel::AVX2:
+            stepFn = &step<Avx2Scan>;
+            break;
+        case ScanLevel::SSE2:
+            stepFn = &step<Sse2Scan>;
+            break;
+#endif
+        default:
+            stepFn = &step<ScalarScan>;
+    }
+}
+
+// ---------------- Parser ----------------
+
+static inline int precedenceOf(TokenType t) noexcept {
+    switch (t) {
+        case TokenType::OR:
+            return 1;
+        case TokenType::AND:
+            return 2;
+        case TokenType::LESS:
+        case TokenType::LESS_EQUAL:
+        case TokenType::GREATER:
+        case TokenType::GREATER_EQUAL:
+        case TokenType::EQUAL_EQUAL:
+        case TokenType::BANG_EQUAL:
+            return 3;
+        case TokenType::DOT_DOT:
+            return 4;
+        case TokenType::PLUS:
+        case TokenType::MINUS:
+            return 5;
+        case TokenType::STAR:
+        case TokenType::SLASH:
+        case TokenType::PERCENT:
+            return 6;
+        case TokenType::CARET:
+            return 8;
+        default:
+            return 0;
+    }
+}
+static inline bool isRightAssociative(TokenType t) noexcept {
+    return t == TokenType::CARET || t == TokenType::DOT_DOT;
+}
+
+// Builds arena nodes for the parser. Child lists are collected on a scratch
+// stack: a list starts at mark() and grows with push(); lists for nested
+// nodes are always finished (attached) before their parent's list grows
+// again, so they never interleave. Attaching copies the list into the arena.
+//
+// Source text given to node() is copied into the arena unless `viewSource`
+// is set, in which case nodes point into the source buffer and the tree
+// has to keep it alive. Synthetic labels ("call", "body", ...) are static
+// strings and are never copied.
+//
+// The grammar code is generic over its builder: anything with this
+// interface and a `Node` handle type will do (see Recognizer and
+// EventBuilder).
+class AstBuilder {
+   public:
+    using Node = AST*;
+
+    AstBuilder(Arena& arena, bool viewSource)
+        : arena(arena), viewSource(viewSource) {
+        scratch.reserve(256);
+    }
+
+    // node whose text is a slice of the source
+    AST* node(ASTType t, sv text, uint32_t offset) {
+        return label(t, viewSource ? text : arena.copy(text), offset);
+    }
+    // node whose text has static storage duration
+    AST* label(ASTType t, sv text, uint32_t offset) {
+        AST* n = arena.allocArray<AST>(1);
+        n->type = t;
+        n->offset = offset;
+        n->text = text;
+        uint8_t count = n->layout().count;
+        if (count) n->slots = arena.allocArray<ChildList>(count);
+        return n;
+    }
+    AST* name(sv text, uint32_t offset, uint32_t symbol) {
+        AST* id = node(ASTType::Identifier, text, offset);
+        id->symbol = symbol;
+        return id;
+    }
+    AST* number(sv text, uint32_t offset, LuaNumber value) {
+        AST* lit = node(ASTType::NumericLiteral, text, offset);
+        lit->number = value;
+        return lit;
+    }
+    AST* str(sv text, uint32_t offset, LuaString value) {
+        AST* lit = node(ASTType::StringLiteral, text, offset);
+        lit->strFlags = uint8_t(value.flags);
+        if (!value.zeroCopy()) {  // decoded once, into the tree's own arena
+            sv v = value.value(arena);
+            lit->decoded = v.data();
+            lit->decodedLen = uint32_t(v.size());
+        }
+        return lit;
+    }
+    static uint32_t offsetOf(const AST* n) noexcept { return n->offset; }
+
+    size_t mark() const noexcept { return scratch.size(); }
+    void push(AST* child) { scratch.push_back(child); }
+    void drop(size_t from) { scratch.resize(from); }
+
+    // slot `s` of `n` takes scratch[from..]; it is printed even when empty
+    void attach(AST* n, Slot s, size_t from) {
+        const SlotLayout& l = n->layout();
+        uint8_t k = 0;
+        while (l.slots[k] != s) ++k;
+        size_t count = scratch.size() - from;
+        AST** items = count ? arena.allocArray<AST*>(count) : nullptr;
+        copy(scratch.begin() + from, scratch.end(), items);
+        n->slots[k] = ChildList{items, uint32_t(count), true};
+        scratch.resize(from);
+    }
+    // like attach(), but an empty list leaves the slot out
+    void attachIfAny(AST* n, Slot s, size_t from) {
+        if (scratch.size() > from) attach(n, s, from);
+    }
+    void attachOne(AST* n, Slot s, AST* child) {
+        push(child);
+        attach(n, s, scratch.size() - 1);
+    }
+
+   private:
+    Arena& arena;
+    bool viewSource;
+    vector<AST*> scratch;
+};
+
+// Builder that makes nothing: a node is just its offset and a child list
+// just a count, so the grammar runs without touching memory beyond the
+// tokens. Used by Validate().
+class Recognizer {
+   public:
+    using Node = uint32_t;
+
+    Node node(ASTType, sv, uint32_t offset) noexcept { return offset; }
+    Node label(ASTType, sv, uint32_t offset) noexcept { return offset; }
+    Node name(sv, uint32_t offset, uint32_t) noexcept { return offset; }
+    Node number(sv, uint32_t offset, LuaNumber) noexcept { return offset; }
+    Node str(sv, uint32_t offset, LuaString) noexcept { return offset; }
+    static uint32_t offsetOf(Node n) noexcept { return n; }
+
+    size_t mark() const noexcept { return pending; }
+    void push(Node) noexcept { ++pending; }
+    void drop(size_t from) noexcept { pending = from; }
+    void attach(Node, Slot, size_t from) noexcept { pending = from; }
+    void attachIfAny(Node, Slot, size_t from) noexcept { pending = from; }
+    void attachOne(Node, Slot, Node) noexcept {}
+
+   private:
+    size_t pending = 0;  // children pushed and not yet attached
+};
+
+template <class Builder>
+using NodeOf = typename Builder::Node;
+
+// Why a parse stopped early, if it did.
+struct ParseError {
+    // Unexpected and Missing only come from strict parses
+    enum class Kind : uint8_t { None, TooDeep, Unexpected, Missing };
+    Kind kind = Kind::None;
+    uint32_t offset = kNoOffset;  // token where parsing stopped
+    uint32_t depth = 0;           // TooDeep: the configured limit
+    // Unexpected: the token found; Missing: the one that should be there
+    TokenType token = TokenType::END_OF_FILE;
+
+    explicit operator bool() const noexcept { return kind != Kind::None; }
+};
+
+static string tokenName(TokenType t) {
+    switch (t) {
+        case TokenType::LEFT_PAREN: return "'('";
+        case TokenType::RIGHT_PAREN: return "')'";
+        case TokenType::LEFT_BRACE: return "'{'";
+        case TokenType::RIGHT_BRACE: return "'}'";
+        case TokenType::LEFT_BRACKET: return "'['";
+        case TokenType::RIGHT_BRACKET: return "']'";
+        case TokenType::COMMA: return "','";
+        case TokenType::DOT: return "'.'";
+        case TokenType::SEMICOLON: return "';'";
+        case TokenType::COLON: return "':'";
+        case TokenType::PLUS: return "'+'";
+        case TokenType::MINUS: return "'-'";
+        case TokenType::STAR: return "'*'";
+        case TokenType::SLASH: return "'/'";
+        case TokenType::PERCENT: return "'%'";
+        case TokenType::CARET: return "'^'";
+        case TokenType::HASH: return "'#'";
+        case TokenType::DOT_DOT: return "'..'";
+        case TokenType::DOT_DOT_DOT: return "'...'";
+        case TokenType::EQUAL: return "'='";
+        case TokenType::EQUAL_EQUAL: return "'=='";
+        case TokenType::BANG_EQUAL: return "'~='";
+        case TokenType::LESS: return "'<'";
+        case TokenType::LESS_EQUAL: return "'<='";
+        case TokenType::GREATER: return "'>'";
+        case TokenType::GREATER_EQUAL: return "'>='";
+        case TokenType::IDENTIFIER: return "name";
+        case TokenType::NUMBER: return "number";
+        case TokenType::STRING: return "string";
+        case TokenType::END_OF_FILE: return "end of input";
+        default:
+            break;
+    }
+    for (const KeywordEntry& k : kKeywords)
+        if (k.type == t) return "'" + string(k.text) + "'";
+    return "token";
+}
+
+// e.g. "expected 'end'"; the caller adds the position
+static string describe(const ParseError& e) {
+    switch (e.kind) {
+        case ParseError::Kind::None:
+            return "ok";
+        case ParseError::Kind::TooDeep:
+            return "expressions nested deeper than " + to_string(e.depth);
+        case ParseError::Kind::Unexpected:
+            return "unexpected " + tokenName(e.token);
+        case ParseError::Kind::Missing:
+            return "expected " + tokenName(e.token);
+    }
+    return "";
+}
+
+struct ParseOptions {
+    // Expression nesting allowed before TooDeep
+    uint32_t maxDepth = 200000;
+    // Stop with Unexpected / Missing at the first spot the parser would
+    // otherwise patch over: a '?' placeholder, a closer it assumes, ...
+    bool strict = false;
+};
+
+// Tokens [first, end) of a top-level statement, and the arena bytes its
+// nodes took. Parsing it looked at tokens up to and including `end`.
+struct StatementSpan {
+    uint32_t first;
+    uint32_t end;
+    uint32_t bytes;
+};
+
+// Source text a tree may view instead of copying: the bytes plus whatever
+// owns them (a string, a MappedFile), kept alive as long as the tree.
+struct SourceRef {
+    shared_ptr<const void> owner;
+    sv text;
+
+    SourceRef() = default;
+    SourceRef(nullptr_t) noexcept {}
+    template <class Buffer>
+    SourceRef(shared_ptr<Buffer> buffer)
+        : owner(buffer),
+          text(buffer ? sv(buffer->data(), buffer->size()) : sv()) {}
+
+    explicit operator bool() const noexcept { return owner != nullptr; }
+    const char* data() const noexcept { return text.data(); }
+    size_t size() const noexcept { return text.size(); }
+};
+
+// A parsed chunk: the top-level statements and the arena that owns every
+// node. Moving a tree keeps its nodes in place; dropping it frees them all
+// at once. Trees parsed in view mode also pin the source their text (and
+// string literal values) point into.
+struct ParseTree {
+    Arena arena{256 * 1024};
+    vector<AST*> statements;
+    vector<StatementSpan> spans;  // one per statement
+    SourceRef source;  // set in view mode
+    ParseError error;  // on error, statements end with the one it hit
+
+    size_t size() const noexcept { return statements.size(); }
+    const AST& operator[](size_t i) const noexcept { return *statements[i]; }
+};
+
+// Identifier leaf for the IDENTIFIER token at `Index`
+template <class Toks, class Builder>
+NodeOf<Builder> makeName(Toks& Tokens, int Index, Builder& B) {
+    return B.name(Tokens.text(Index), Tokens.offset(Index),
+                  Tokens.symbol(Index));
+}
+
+// Single-token primary expression at `Index`. Anything else becomes a
+// '?' placeholder; ExprParser handles '(', '{' and function itself.
+template <class Toks, class Builder>
+NodeOf<Builder> parseLeaf(Toks& Tokens, int& Index, Builder& B) {
+    if (!Tokens.has(Index))
+        return B.label(ASTType::Identifier, "<?>", kNoOffset);
+    const Token tk = Tokens[Index];
     switch (tk.type) {
         case TokenType::NUMBER:
-            ++Index;
-            return makeLeaf(ASTType::NumericLiteral, tk.text, tk.line);
+            return B.number(tk.text, tk.offset, Tokens.number(Index++));
         case TokenType::STRING:
-            ++Index;
-            return makeLeaf(ASTType::StringLiteral, tk.text, tk.line);
+            return B.str(tk.text, tk.offset, Tokens.str(Index++));
         case TokenType::TRUE_:
         case TokenType::FALSE_:
             ++Index;
-            return makeLeaf(ASTType::BooleanLiteral, tk.text, tk.line);
+            return B.node(ASTType::BooleanLiteral, tk.text, tk.offset);
         case TokenType::NIL:
             ++Index;
-            return makeLeaf(ASTType::NilLiteral, "nil", tk.line);
+            return B.label(ASTType::NilLiteral, "nil", tk.offset);
         case TokenType::IDENTIFIER:
-            ++Index;
-            return makeLeaf(ASTType::Identifier, tk.text, tk.line);
+            return makeName(Tokens, Index++, B);
         case TokenType::DOT_DOT_DOT:
             ++Index;
-            return makeLeaf(ASTType::VarargLiteral, "...", tk.line);
-        case TokenType::LEFT_PAREN: {
+            return B.label(ASTType::VarargLiteral, "...", tk.offset);
+        default:
             ++Index;
-            AST inner = parseExpressionForwardDecl(Tokens, Index);
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::RIGHT_PAREN)
-                ++Index;
-            return inner;
+            return B.label(ASTType::Identifier, sv("?"), tk.offset);
+    }
+}
+
+// Expression parser used by parseChunk. It is recursive descent up to
+// kNativeDepth nested expressions; anything deeper is handed to a state
+// machine (run / step) that runs the same grammar but keeps its pending
+// work in a heap-allocated frame stack instead of native stack frames.
+// Both build the same nodes in the same order. Nesting beyond maxDepth
+// stops the parse with a TooDeep error rather than overflowing.
+template <class Toks, class Builder = AstBuilder>
+class ExprParser {
+    using Node = NodeOf<Builder>;
+
+   public:
+    ExprParser(Toks& Tokens, Builder& B, const ParseOptions& opts,
+               ParseError& error)
+        : Tokens(Tokens), B(B), opts(opts), error(error) {}
+
+    Node expression(int& Index) {
+        size_t scratch = B.mark();
+        depth = 0;
+        Node n = binary(Index, 1);
+        return error ? fail(scratch) : n;
+    }
+    Node suffixed(int& Index) {
+        size_t scratch = B.mark();
+        depth = 0;
+        Node n = suffixedExpr(Index);
+        return error ? fail(scratch) : n;
+    }
+    // pushes the expressions of a comma-separated list onto B's scratch
+    void list(int& Index) {
+        if (!Tokens.has(Index)) return;
+        B.push(expression(Index));
+        while (Tokens.has(Index) && Tokens.type(Index) == TokenType::COMMA) {
+            ++Index;
+            B.push(expression(Index));
+        }
+    }
+
+    // Recovery points. Outside strict mode they only consume what is there.
+    bool expect(int& Index, TokenType t) {
+        if (at(Index, t)) {
+            ++Index;
+            return true;
+        }
+        missing(Index, t);
+        return false;
+    }
+    void missing(int& Index, TokenType t) {
+        if (opts.strict) stop(Index, ParseError::Kind::Missing, t);
+    }
+    void unexpected(int& Index) {
+        if (opts.strict)
+            stop(Index, ParseError::Kind::Unexpected,
+                 Tokens.has(Index) ? Tokens.type(Index)
+                                   : TokenType::END_OF_FILE);
+    }
+    // A parameter list drops anything but names; '...' is the only such
+    // token strict mode lets through.
+    void skipParam(int& Index) {
+        if (Tokens.type(Index) != TokenType::DOT_DOT_DOT) unexpected(Index);
+        ++Index;
+    }
+
+   private:
+    // Each level of nesting recurses through binary, suffixedExpr and
+    // primaryExpr: a few hundred bytes of native stack, so under 100 KB
+    // in all, well inside any thread's default stack.
+    static constexpr uint32_t kNativeDepth = 256;
+
+    // on error the expression is replaced by a placeholder
+    Node fail(size_t scratch) {
+        B.drop(scratch);
+        return B.label(ASTType::Identifier, sv("<?>"), kNoOffset);
+    }
+
+    Node binary(int& Index, int minPrec) {
+        if (depth >= kNativeDepth) return run(Index, minPrec);
+        if (++depth > opts.maxDepth) {
+            stop(Index, ParseError::Kind::TooDeep, TokenType::END_OF_FILE);
+            --depth;
+            return B.label(ASTType::Identifier, sv("<?>"), kNoOffset);
+        }
+        Node result = binaryBody(Index, minPrec);
+        --depth;
+        return result;
+    }
+    Node binaryBody(int& Index, int minPrec) {
+        if (!Tokens.has(Index)) {
+            unexpected(Index);
+            return B.label(ASTType::Identifier, sv("<?>"), kNoOffset);
         }
-        case TokenType::LEFT_BRACE: {
-            int line = tk.line;
+        TokenType tt = Tokens.type(Index);
+        if (tt == TokenType::MINUS || tt == TokenType::NOT ||
+            tt == TokenType::HASH) {
+            const Token t = Tokens[Index];
             ++Index;
-            vector<AST> elements;
-            elements.reserve(4);
-            while (Index < (int)Tokens.size() &&
-                   Tokens[Index].type != TokenType::RIGHT_BRACE) {
-                AST val = parseExpressionForwardDecl(Tokens, Index);
-                AST tv = makeLeaf(ASTType::TableValue, sv(), val.line);
-                // named slot for value
-                tv.children["value"].push_back(move(val));
-                elements.emplace_back(move(tv));
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::COMMA)
-                    ++Index;
-                else
-                    break;
-            }
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::RIGHT_BRACE)
-                ++Index;
-            AST table =
-                makeLeaf(ASTType::TableConstructorExpression, sv(), line);
-            table.children["fields"] = move(elements);
-            return table;
+            Node arg = binary(Index, 9);
+            Node un = B.node(ASTType::UnaryExpression, t.text, t.offset);
+            B.attachOne(un, Slot::Argument, arg);
+            return un;
         }
-        case TokenType::FUNCTION: {
-            int line = tk.line;
+        Node left = suffixedExpr(Index);
+        while (Tokens.has(Index)) {
+            tt = Tokens.type(Index);
+            int prec = precedenceOf(tt);
+            if (prec == 0 || prec < minPrec) break;
+            const Token op = Tokens[Index];
             ++Index;
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::LEFT_PAREN) {
+            Node right = binary(Index, prec + (isRightAssociative(tt) ? 0 : 1));
+            Node bin = B.node(ASTType::BinaryExpression, op.text, op.offset);
+            B.attachOne(bin, Slot::Left, left);
+            B.attachOne(bin, Slot::Right, right);
+            left = bin;
+        }
+        return left;
+    }
+
+    Node suffixedExpr(int& Index) {
+        Node expr = primaryExpr(Index);
+        while (Tokens.has(Index)) {
+            TokenType tt = Tokens.type(Index);
+            uint32_t pos = Tokens.offset(Index);
+            Node node;
+            if (tt == TokenType::DOT) {
                 ++Index;
-                vector<AST> params;
-                params.reserve(4);
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type != TokenType::RIGHT_PAREN) {
-                    if (Tokens[Index].type == TokenType::IDENTIFIER) {
-                        params.push_back(makeLeaf(ASTType::Identifier,
-                                                  Tokens[Index].text,
-                                                  Tokens[Index].line));
-                        ++Index;
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::COMMA)
-                            ++Index;
-                    } else
-                        ++Index;
+                if (!at(Index, TokenType::IDENTIFIER)) {
+                    missing(Index, TokenType::IDENTIFIER);
+                    break;
                 }
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::RIGHT_PAREN)
+                Node member = makeName(Tokens, Index, B);
+                ++Index;
+                node = B.label(ASTType::MemberExpression, sv("."), pos);
+                B.attachOne(node, Slot::Object, expr);
+                B.attachOne(node, Slot::Property, member);
+            } else if (tt == TokenType::LEFT_BRACKET) {
+                ++Index;
+                Node key = binary(Index, 1);
+                expect(Index, TokenType::RIGHT_BRACKET);
+                node = B.label(ASTType::IndexExpression, sv("[]"), pos);
+                B.attachOne(node, Slot::Object, expr);
+                B.attachOne(node, Slot::Index, key);
+            } else if (tt == TokenType::LEFT_PAREN) {
+                ++Index;
+                size_t args = B.mark();
+                while (Tokens.has(Index) &&
+                       Tokens.type(Index) != TokenType::RIGHT_PAREN) {
+                    B.push(binary(Index, 1));
+                    if (!at(Index, TokenType::COMMA)) break;
                     ++Index;
-                vector<AST> body;
-                body.reserve(8);
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type != TokenType::END) {
-                    if (Tokens[Index].type == TokenType::RETURN) {
-                        int rline = Tokens[Index].line;
-                        ++Index;
-                        AST ev = parseExpressionForwardDecl(Tokens, Index);
-                        AST ret = makeLeaf(ASTType::ReturnStatement,
-                                           sv("return"), rline);
-                        ret.children["values"].push_back(move(ev));
-                        body.push_back(move(ret));
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::SEMICOLON)
-                            ++Index;
-                        continue;
-                    }
-                    AST ev = parseExpressionForwardDecl(Tokens, Index);
-                    body.push_back(move(ev));
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::SEMICOLON)
-                        ++Index;
                 }
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::END)
-                    ++Index;
-                AST fn = makeLeaf(ASTType::FunctionExpression, sv(), line);
-
-                AST blk = makeLeaf(ASTType::Block, sv("body"), line);
-                blk.children["statements"] = move(body);
-
-                fn.children["body"].push_back(move(blk));
-                if (!params.empty()) fn.children["params"] = move(params);
-                return fn;
+                expect(Index, TokenType::RIGHT_PAREN);
+                node = B.label(ASTType::CallExpression, sv("call"), pos);
+                B.attachIfAny(node, Slot::Arguments, args);
+                B.attachOne(node, Slot::Callee, expr);
+            } else {
+                break;
             }
-            return makeLeaf(ASTType::FunctionExpression, sv(), tk.line);
+            expr = node;
         }
-        default:
-            ++Index;
-            return makeLeaf(ASTType::Identifier, sv("?"), tk.line);
+        return expr;
     }
-}
 
-AST parseSuffixed(const vector<Token>& Tokens, int& Index) {
-    AST expr = parsePrimary(Tokens, Index);
-    while (Index < (int)Tokens.size()) {
-        const Token& t = Tokens[Index];
-        if (t.type == TokenType::DOT) {
-            ++Index;
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::IDENTIFIER) {
-                AST member = makeLeaf(ASTType::Identifier, Tokens[Index].text,
-                                      Tokens[Index].line);
+    Node primaryExpr(int& Index) {
+        if (!Tokens.has(Index) || !opensScope(Tokens.type(Index))) {
+            if (!Tokens.has(Index) || !isLeaf(Tokens.type(Index)))
+                unexpected(Index);  // parseLeaf makes a '?' for it
+            return parseLeaf(Tokens, Index, B);
+        }
+        const Token tk = Tokens[Index];
+        ++Index;
+        if (tk.type == TokenType::LEFT_PAREN) {
+            Node inner = binary(Index, 1);
+            expect(Index, TokenType::RIGHT_PAREN);
+            return inner;
+        }
+        if (tk.type == TokenType::LEFT_BRACE) {
+            size_t fields = B.mark();
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) != TokenType::RIGHT_BRACE) {
+                Node val = binary(Index, 1);
+                Node tv = B.label(ASTType::TableValue, sv(), B.offsetOf(val));
+                B.attachOne(tv, Slot::Value, val);
+                B.push(tv);
+                if (!at(Index, TokenType::COMMA)) break;
                 ++Index;
-                AST node = makeLeaf(ASTType::MemberExpression, sv("."), t.line);
-                // named slots
-                node.children["object"].push_back(move(expr));
-                node.children["property"].push_back(move(member));
-                expr = move(node);
-                continue;
             }
-            break;
-        } else if (t.type == TokenType::LEFT_BRACKET) {
-            ++Index;
-            AST key = parseExpressionForwardDecl(Tokens, Index);
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::RIGHT_BRACKET)
+            expect(Index, TokenType::RIGHT_BRACE);
+            Node table =
+                B.label(ASTType::TableConstructorExpression, sv(), tk.offset);
+            B.attach(table, Slot::Fields, fields);
+            return table;
+        }
+        // function: without a parameter list it is an empty expression
+        if (!expect(Index, TokenType::LEFT_PAREN))
+            return B.label(ASTType::FunctionExpression, sv(), tk.offset);
+        size_t params = B.mark();
+        parameters(Index);
+        size_t body = B.mark();
+        while (Tokens.has(Index) && Tokens.type(Index) != TokenType::END) {
+            if (Tokens.type(Index) == TokenType::RETURN) {
+                uint32_t pos = Tokens.offset(Index);
                 ++Index;
-            AST node = makeLeaf(ASTType::IndexExpression, sv("[]"), t.line);
-            node.children["object"].push_back(move(expr));
-            node.children["index"].push_back(move(key));
-            expr = move(node);
-            continue;
-        } else if (t.type == TokenType::LEFT_PAREN) {
-            ++Index;
-            vector<AST> args;
-            args.reserve(4);
-            while (Index < (int)Tokens.size() &&
-                   Tokens[Index].type != TokenType::RIGHT_PAREN) {
-                AST a = parseExpressionForwardDecl(Tokens, Index);
-                args.push_back(move(a));
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::COMMA)
-                    ++Index;
-                else
-                    break;
+                Node value = binary(Index, 1);
+                Node r =
+                    B.label(ASTType::ReturnStatement, sv("return"), pos);
+                B.attachOne(r, Slot::Values, value);
+                B.push(r);
+            } else {
+                B.push(binary(Index, 1));
             }
-            if (Index < (int)Tokens.size() &&
-                Tokens[Index].type == TokenType::RIGHT_PAREN)
+            if (at(Index, TokenType::SEMICOLON)) ++Index;
+        }
+        expect(Index, TokenType::END);
+        Node fn = B.label(ASTType::FunctionExpression, sv(), tk.offset);
+        Node blk = B.label(ASTType::Block, sv("body"), tk.offset);
+        B.attach(blk, Slot::Statements, body);
+        B.attachOne(fn, Slot::Body, blk);
+        B.attachIfAny(fn, Slot::Params, params);
+        return fn;
+    }
+    // pushes the names of a parameter list, up to and including its ')'
+    void parameters(int& Index) {
+        while (Tokens.has(Index) &&
+               Tokens.type(Index) != TokenType::RIGHT_PAREN) {
+            if (Tokens.type(Index) == TokenType::IDENTIFIER) {
+                B.push(makeName(Tokens, Index, B));
                 ++Index;
-            AST node = makeLeaf(ASTType::CallExpression, sv("call"), t.line);
-            node.children["callee"].push_back(move(expr));
-            if (!args.empty()) node.children["arguments"] = move(args);
-            expr = move(node);
-            continue;
-        } else
-            break;
+                if (at(Index, TokenType::COMMA)) ++Index;
+            } else {
+                skipParam(Index);
+            }
+        }
+        expect(Index, TokenType::RIGHT_PAREN);
     }
-    return expr;
-}
 
-AST parseBinary(const vector<Token>& Tokens, int& Index, int minPrec) {
-    if (Index >= (int)Tokens.size())
-        return makeLeaf(ASTType::Identifier, sv("<?>"), 0);
-    const Token& t = Tokens[Index];
-    if (t.type == TokenType::MINUS || t.type == TokenType::NOT ||
-        t.type == TokenType::HASH) {
-        int line = t.line;
-        ++Index;
-        AST right = parseBinary(Tokens, Index, 9);
-        AST un = makeLeaf(ASTType::UnaryExpression, t.text, line);
-        un.children["argument"].push_back(move(right));
-        return un;
-    }
+    // Resume points. A frame's step says what to do with `ret`, the value
+    // returned by the frame just popped. Steps before PrimaryStart belong
+    // to binary() and count towards the nesting depth; the operand's
+    // suffix chain runs in the same frame, before ExprLoop.
+    enum class Step : uint8_t {
+        ExprStart,
+        ExprUnary,   // ret: operand of a unary operator
+        ExprLoop,    // ret: left operand so far
+        ExprRight,   // ret: right operand of `op`
+        SuffixLoop,  // ret: expression so far
+        SuffixKey,   // ret: key of `left[...]`
+        SuffixArgs,  // next call argument, or the closing ')'
+        SuffixArg,   // ret: one call argument
+        PrimaryStart,
+        PrimaryParen,  // ret: parenthesised expression
+        TableNext,
+        TableValue,  // ret: table field value
+        FuncNext,
+        FuncReturn,  // ret: value of a `return` in a function body
+        FuncStmt     // ret: expression statement in a function body
+    };
 
-    AST left = parseSuffixed(Tokens, Index);
+    struct Frame {
+        Step step;
+        int8_t minPrec = 1;
+        uint32_t pos = 0;    // offset of the construct's first token
+        uint32_t pos2 = 0;   // FuncReturn: offset of `return`
+        uint32_t mark = 0;   // scratch mark of the list being built
+        uint32_t mark2 = 0;  // FuncNext: scratch mark of the body
+        sv opText;           // operator of a unary / binary expression
+        Node left = Node();
+    };
 
-    while (Index < (int)Tokens.size()) {
-        const Token& op = Tokens[Index];
-        int prec = precedenceOf(op);
-        if (prec == 0 || prec < minPrec) break;
-        ++Index;
-        int nextMin = prec + (isRightAssociative(op) ? 0 : 1);
-        AST right = parseBinary(Tokens, Index, nextMin);
-        AST bin = makeLeaf(ASTType::BinaryExpression, op.text, op.line);
-        bin.children["left"].push_back(move(left));
-        bin.children["right"].push_back(move(right));
-        left = move(bin);
-    }
-    return left;
-}
+    // Frames in fixed-size chunks. A deep expression never copies them,
+    // and chunks stay small enough for malloc to hand out again to the
+    // tree's arena: one large buffer, grown by doubling, would be mmap()ed
+    // and raise malloc's mmap and trim thresholds, after which the arena
+    // blocks of every later parse come back as fresh pages.
+    class FrameStack {
+       public:
+        bool empty() const noexcept { return count == 0; }
+        Frame& back() noexcept {
+            return chunks[(count - 1) / kChunk][(count - 1) % kChunk];
+        }
+        void push_back(const Frame& f) {
+            if (count == chunks.size() * kChunk)
+                chunks.emplace_back(new Frame[kChunk]);
+            chunks[count / kChunk][count % kChunk] = f;
+            ++count;
+        }
+        void pop_back() noexcept { --count; }
+        void clear() noexcept { count = 0; }
 
-AST parseExpressionForwardDecl(const vector<Token>& Tokens, int& Index) {
-    return parseBinary(Tokens, Index, 1);
-}
+       private:
+        static constexpr size_t kChunk = 1024;
+        vector<unique_ptr<Frame[]>> chunks;
+        size_t count = 0;
+    };
 
-vector<AST> parseExpressionList(const vector<Token>& Tokens, int& Index) {
-    vector<AST> res;
-    if (Index >= (int)Tokens.size()) return res;
-    res.push_back(parseExpressionForwardDecl(Tokens, Index));
-    while (Index < (int)Tokens.size() &&
-           Tokens[Index].type == TokenType::COMMA) {
-        ++Index;
-        res.push_back(parseExpressionForwardDecl(Tokens, Index));
+    bool call(int& Index, Step step, int minPrec = 1) {
+        if (step == Step::ExprStart && ++depth > opts.maxDepth) {
+            stop(Index, ParseError::Kind::TooDeep, TokenType::END_OF_FILE);
+            return false;
+        }
+        Frame f;
+        f.step = step;
+        f.minPrec = int8_t(minPrec);
+        stack.push_back(f);
+        return true;
+    }
+    void leave(Node value) {
+        if (stack.back().step < Step::PrimaryStart) --depth;
+        stack.pop_back();
+        ret = value;
+    }
+    // the first error wins; later ones are fallout from the stop
+    void stop(int& Index, ParseError::Kind kind, TokenType token) {
+        if (!error) {
+            error.kind = kind;
+            error.offset =
+                Tokens.has(Index) ? Tokens.offset(Index) : kNoOffset;
+            error.depth = opts.maxDepth;
+            error.token = token;
+        }
+        Index = kStopIndex;
+    }
+    bool at(int Index, TokenType t) {
+        return Tokens.has(Index) && Tokens.type(Index) == t;
     }
-    return res;
-}
 
-// Top-level parse
-vector<AST> Parse(const vector<Token>& Tokens) {
-    bool Running = true;
-    int Index = 0;
-    vector<AST> Chunk;
-    Chunk.reserve(64);
+    // binary(), without native recursion; `depth` carries on from there
+    Node run(int& Index, int minPrec) {
+        size_t scratch = B.mark();
+        stack.clear();
+        ret = Node();
+        call(Index, Step::ExprStart, minPrec);
+        while (!stack.empty() && !error) step(Index);
+        return error ? fail(scratch) : ret;
+    }
 
-    while (Running && Index < (int)Tokens.size()) {
-        const Token& t = Tokens[Index];
-        switch (t.type) {
-            case TokenType::END_OF_FILE:
-                Running = false;
-                break;
-            case TokenType::SEMICOLON:
-                ++Index;
-                break;
-            case TokenType::LOCAL: {
-                int line = t.line;
-                ++Index;
-                vector<AST> vars;
-                vars.reserve(4);
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type == TokenType::IDENTIFIER) {
-                    vars.push_back(makeLeaf(ASTType::Identifier,
-                                            Tokens[Index].text,
-                                            Tokens[Index].line));
-                    ++Index;
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::COMMA)
-                        ++Index;
-                    else
-                        break;
+    void step(int& Index) {
+        // `f` is only valid until the next call() or leave()
+        Frame& f = stack.back();
+        switch (f.step) {
+            case Step::ExprStart: {
+                if (!Tokens.has(Index)) {
+                    unexpected(Index);
+                    return leave(
+                        B.label(ASTType::Identifier, sv("<?>"), kNoOffset));
                 }
-                vector<AST> vals;
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::EQUAL) {
+                TokenType tt = Tokens.type(Index);
+                if (tt == TokenType::MINUS || tt == TokenType::NOT ||
+                    tt == TokenType::HASH) {
+                    f.opText = Tokens.text(Index);
+                    f.pos = Tokens.offset(Index);
                     ++Index;
-                    vals = parseExpressionList(Tokens, Index);
+                    f.step = Step::ExprUnary;
+                    call(Index, Step::ExprStart, 9);
+                    return;
                 }
-                AST node = makeLeaf(ASTType::LocalStatement, sv("local"), line);
-                if (!vars.empty()) node.children["variables"] = move(vars);
-                if (!vals.empty()) node.children["values"] = move(vals);
-                Chunk.push_back(move(node));
-                break;
+                f.step = Step::SuffixLoop;
+                // leaves need no frame of their own: most operands are one
+                // token
+                if (isLeaf(tt)) {
+                    ret = parseLeaf(Tokens, Index, B);
+                    return;
+                }
+                call(Index, Step::PrimaryStart);
+                return;
             }
-            case TokenType::RETURN: {
-                int line = t.line;
+            case Step::ExprUnary: {
+                Node un = B.node(ASTType::UnaryExpression, f.opText, f.pos);
+                B.attachOne(un, Slot::Argument, ret);
+                return leave(un);
+            }
+            case Step::ExprLoop: {
+                f.left = ret;
+                if (!Tokens.has(Index)) return leave(f.left);
+                TokenType tt = Tokens.type(Index);
+                int prec = precedenceOf(tt);
+                if (prec == 0 || prec < f.minPrec) return leave(f.left);
+                f.opText = Tokens.text(Index);
+                f.pos = Tokens.offset(Index);
                 ++Index;
-                vector<AST> vals;
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type != TokenType::SEMICOLON) {
-                    vals = parseExpressionList(Tokens, Index);
+                f.step = Step::ExprRight;
+                call(Index, Step::ExprStart,
+                     prec + (isRightAssociative(tt) ? 0 : 1));
+                return;
+            }
+            case Step::ExprRight: {
+                Node bin = B.node(ASTType::BinaryExpression, f.opText, f.pos);
+                B.attachOne(bin, Slot::Left, f.left);
+                B.attachOne(bin, Slot::Right, ret);
+                ret = bin;
+                f.step = Step::ExprLoop;
+                return;
+            }
+
+            case Step::SuffixLoop: {
+                Node expr = f.left = ret;
+                if (!Tokens.has(Index)) return endSuffix(f, expr);
+                TokenType tt = Tokens.type(Index);
+                if (tt == TokenType::DOT) {
+                    uint32_t pos = Tokens.offset(Index);
+                    ++Index;
+                    if (!at(Index, TokenType::IDENTIFIER)) {
+                        missing(Index, TokenType::IDENTIFIER);
+                        return endSuffix(f, expr);
+                    }
+                    Node member = makeName(Tokens, Index, B);
+                    ++Index;
+                    Node node =
+                        B.label(ASTType::MemberExpression, sv("."), pos);
+                    B.attachOne(node, Slot::Object, expr);
+                    B.attachOne(node, Slot::Property, member);
+                    ret = node;
+                    return;
                 }
-                AST node =
-                    makeLeaf(ASTType::ReturnStatement, sv("return"), line);
-                if (!vals.empty()) node.children["values"] = move(vals);
-                Chunk.push_back(move(node));
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::SEMICOLON)
+                if (tt == TokenType::LEFT_BRACKET) {
+                    f.pos = Tokens.offset(Index);
+                    ++Index;
+                    f.step = Step::SuffixKey;
+                    call(Index, Step::ExprStart);
+                    return;
+                }
+                if (tt == TokenType::LEFT_PAREN) {
+                    f.pos = Tokens.offset(Index);
+                    ++Index;
+                    f.mark = uint32_t(B.mark());
+                    f.step = Step::SuffixArgs;
+                    return;
+                }
+                return endSuffix(f, expr);
+            }
+            case Step::SuffixKey: {
+                expect(Index, TokenType::RIGHT_BRACKET);
+                Node node = B.label(ASTType::IndexExpression, sv("[]"), f.pos);
+                B.attachOne(node, Slot::Object, f.left);
+                B.attachOne(node, Slot::Index, ret);
+                ret = node;
+                f.step = Step::SuffixLoop;
+                return;
+            }
+            case Step::SuffixArg:
+                B.push(ret);
+                if (!at(Index, TokenType::COMMA)) return finishCall(Index, f);
+                ++Index;
+                f.step = Step::SuffixArgs;
+                return;
+            case Step::SuffixArgs:
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) != TokenType::RIGHT_PAREN) {
+                    f.step = Step::SuffixArg;
+                    call(Index, Step::ExprStart);
+                    return;
+                }
+                return finishCall(Index, f);
+
+            case Step::PrimaryStart:
+                return primary(Index, f);
+            case Step::PrimaryParen:
+                expect(Index, TokenType::RIGHT_PAREN);
+                return leave(ret);
+            case Step::TableValue: {
+                Node tv = B.label(ASTType::TableValue, sv(), B.offsetOf(ret));
+                B.attachOne(tv, Slot::Value, ret);
+                B.push(tv);
+                if (!at(Index, TokenType::COMMA)) return finishTable(Index, f);
+                ++Index;
+                f.step = Step::TableNext;
+                return;
+            }
+            case Step::TableNext:
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) != TokenType::RIGHT_BRACE) {
+                    f.step = Step::TableValue;
+                    call(Index, Step::ExprStart);
+                    return;
+                }
+                return finishTable(Index, f);
+            case Step::FuncReturn: {
+                Node r = B.label(ASTType::ReturnStatement, sv("return"),
+                                 f.pos2);
+                B.attachOne(r, Slot::Values, ret);
+                B.push(r);
+                if (at(Index, TokenType::SEMICOLON)) ++Index;
+                f.step = Step::FuncNext;
+                return;
+            }
+            case Step::FuncStmt:
+                B.push(ret);
+                if (at(Index, TokenType::SEMICOLON)) ++Index;
+                f.step = Step::FuncNext;
+                return;
+            case Step::FuncNext:
+                if (!Tokens.has(Index) ||
+                    Tokens.type(Index) == TokenType::END)
+                    return finishFunction(Index, f);
+                if (Tokens.type(Index) == TokenType::RETURN) {
+                    f.pos2 = Tokens.offset(Index);
+                    ++Index;
+                    f.step = Step::FuncReturn;
+                } else {
+                    f.step = Step::FuncStmt;
+                }
+                call(Index, Step::ExprStart);
+                return;
+        }
+    }
+
+    // end of the operand's suffix chain; on to its binary operators
+    void endSuffix(Frame& f, Node expr) {
+        ret = expr;
+        f.step = Step::ExprLoop;
+    }
+
+    void primary(int& Index, Frame& f) {
+        if (!Tokens.has(Index) || !opensScope(Tokens.type(Index))) {
+            if (!Tokens.has(Index) || !isLeaf(Tokens.type(Index)))
+                unexpected(Index);  // parseLeaf makes a '?' for it
+            return leave(parseLeaf(Tokens, Index, B));
+        }
+        const Token tk = Tokens[Index];
+        ++Index;
+        f.pos = tk.offset;
+        if (tk.type == TokenType::LEFT_PAREN) {
+            f.step = Step::PrimaryParen;
+            call(Index, Step::ExprStart);
+            return;
+        }
+        if (tk.type == TokenType::LEFT_BRACE) {
+            f.mark = uint32_t(B.mark());
+            f.step = Step::TableNext;
+            return;
+        }
+        // function: without a parameter list it is an empty expression
+        if (!expect(Index, TokenType::LEFT_PAREN))
+            return leave(
+                B.label(ASTType::FunctionExpression, sv(), tk.offset));
+        f.mark = uint32_t(B.mark());
+        parameters(Index);
+        f.mark2 = uint32_t(B.mark());
+        f.step = Step::FuncNext;
+    }
+    static bool opensScope(TokenType t) noexcept {
+        return t == TokenType::LEFT_PAREN || t == TokenType::LEFT_BRACE ||
+               t == TokenType::FUNCTION;
+    }
+    // tokens parseLeaf turns into a node of their own
+    static bool isLeaf(TokenType t) noexcept {
+        switch (t) {
+            case TokenType::NUMBER:
+            case TokenType::STRING:
+            case TokenType::TRUE_:
+            case TokenType::FALSE_:
+            case TokenType::NIL:
+            case TokenType::IDENTIFIER:
+            case TokenType::DOT_DOT_DOT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void finishCall(int& Index, Frame& f) {
+        expect(Index, TokenType::RIGHT_PAREN);
+        Node node = B.label(ASTType::CallExpression, sv("call"), f.pos);
+        B.attachIfAny(node, Slot::Arguments, f.mark);
+        B.attachOne(node, Slot::Callee, f.left);
+        ret = node;
+        f.step = Step::SuffixLoop;
+    }
+    void finishTable(int& Index, Frame& f) {
+        expect(Index, TokenType::RIGHT_BRACE);
+        Node table =
+            B.label(ASTType::TableConstructorExpression, sv(), f.pos);
+        B.attach(table, Slot::Fields, f.mark);
+        leave(table);
+    }
+    void finishFunction(int& Index, Frame& f) {
+        expect(Index, TokenType::END);
+        Node fn = B.label(ASTType::FunctionExpression, sv(), f.pos);
+        Node blk = B.label(ASTType::Block, sv("body"), f.pos);
+        B.attach(blk, Slot::Statements, f.mark2);
+        B.attachOne(fn, Slot::Body, blk);
+        B.attachIfAny(fn, Slot::Params, f.mark);
+        leave(fn);
+    }
+
+    Toks& Tokens;
+    Builder& B;
+    const ParseOptions& opts;
+    ParseError& error;
+    FrameStack stack;
+    uint32_t depth = 0;
+    Node ret = Node();
+};
+
+// Parses the top-level statement at Index, appending it to `Chunk`
+// (separators append nothing). False at the end of the input.
+template <class Toks, class Builder, class Node = NodeOf<Builder>>
+bool parseStatement(Toks& Tokens, int& Index, Builder& B,
+                    ExprParser<Toks, Builder>& E, vector<Node>& Chunk) {
+    const Token t = Tokens[Index];
+    switch (t.type) {
+        case TokenType::END_OF_FILE:
+            return false;
+        case TokenType::SEMICOLON:
+            ++Index;
+            break;
+        case TokenType::LOCAL: {
+            uint32_t pos = t.offset;
+            ++Index;
+            size_t vars = B.mark();
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) == TokenType::IDENTIFIER) {
+                B.push(makeName(Tokens, Index, B));
+                ++Index;
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) == TokenType::COMMA)
+                    ++Index;
+                else
+                    break;
+            }
+            if (B.mark() == vars) E.missing(Index, TokenType::IDENTIFIER);
+            size_t vals = B.mark();
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) == TokenType::EQUAL) {
+                ++Index;
+                E.list(Index);
+            }
+            Node node = B.label(ASTType::LocalStatement, sv("local"), pos);
+            B.attachIfAny(node, Slot::Values, vals);
+            B.attachIfAny(node, Slot::Variables, vars);
+            Chunk.push_back(node);
+            break;
+        }
+        case TokenType::RETURN: {
+            uint32_t pos = t.offset;
+            ++Index;
+            size_t vals = B.mark();
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) != TokenType::SEMICOLON) {
+                E.list(Index);
+            }
+            Node node =
+                B.label(ASTType::ReturnStatement, sv("return"), pos);
+            B.attachIfAny(node, Slot::Values, vals);
+            Chunk.push_back(node);
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) == TokenType::SEMICOLON)
+                ++Index;
+            break;
+        }
+        case TokenType::IF: {
+            uint32_t pos = t.offset;
+            ++Index;
+            size_t clauses = B.mark();
+            Node cond = E.expression(Index);
+            E.expect(Index, TokenType::THEN);
+
+            // then block
+            size_t thenBlock = B.mark();
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) != TokenType::ELSE &&
+                   Tokens.type(Index) != TokenType::ELSEIF &&
+                   Tokens.type(Index) != TokenType::END) {
+                B.push(E.expression(Index));
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) == TokenType::SEMICOLON)
+                    ++Index;
+                if (!Tokens.has(Index)) break;
+            }
+            Node ifcl = B.label(ASTType::IfClause, sv("if"), pos);
+            Node thenblk = B.label(ASTType::Block, sv("then"), pos);
+            B.attachIfAny(thenblk, Slot::Statements, thenBlock);
+            B.attachOne(ifcl, Slot::Condition, cond);
+            B.attachOne(ifcl, Slot::Body, thenblk);
+            B.push(ifcl);
+
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) == TokenType::ELSEIF) {
+                uint32_t elifPos = Tokens.offset(Index);
+                ++Index;
+                Node elifCond =
+                    E.expression(Index);
+                E.expect(Index, TokenType::THEN);
+                size_t elifBlock = B.mark();
+                while (Tokens.has(Index) &&
+                       Tokens.type(Index) != TokenType::ELSE &&
+                       Tokens.type(Index) != TokenType::ELSEIF &&
+                       Tokens.type(Index) != TokenType::END) {
+                    B.push(E.expression(Index));
+                    if (Tokens.has(Index) &&
+                        Tokens.type(Index) == TokenType::SEMICOLON)
+                        ++Index;
+                    if (!Tokens.has(Index)) break;
+                }
+                Node elifcl =
+                    B.label(ASTType::ElseifClause, sv("elseif"), elifPos);
+                Node elifblk =
+                    B.label(ASTType::Block, sv("elseif"), elifPos);
+                B.attachIfAny(elifblk, Slot::Statements, elifBlock);
+                B.attachOne(elifcl, Slot::Condition, elifCond);
+                B.attachOne(elifcl, Slot::Body, elifblk);
+                B.push(elifcl);
+            }
+
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) == TokenType::ELSE) {
+                uint32_t elsePos = Tokens.offset(Index);
+                ++Index;
+                size_t elseBlock = B.mark();
+                while (Tokens.has(Index) &&
+                       Tokens.type(Index) != TokenType::END) {
+                    B.push(E.expression(Index));
+                    if (Tokens.has(Index) &&
+                        Tokens.type(Index) == TokenType::SEMICOLON)
+                        ++Index;
+                    if (!Tokens.has(Index)) break;
+                }
+                Node ech =
+                    B.label(ASTType::ElseClause, sv("else"), elsePos);
+                Node eb = B.label(ASTType::Block, sv("else"), elsePos);
+                B.attachIfAny(eb, Slot::Statements, elseBlock);
+                B.attachOne(ech, Slot::Body, eb);
+                B.push(ech);
+            }
+
+            E.expect(Index, TokenType::END);
+            Node ifnode = B.label(ASTType::IfStatement, sv("if"), pos);
+            B.attachIfAny(ifnode, Slot::Clauses, clauses);
+            Chunk.push_back(ifnode);
+            break;
+        }
+        case TokenType::WHILE: {
+            uint32_t pos = t.offset;
+            ++Index;
+            Node cond = E.expression(Index);
+            E.expect(Index, TokenType::DO);
+            size_t body = B.mark();
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) != TokenType::END) {
+                B.push(E.expression(Index));
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) == TokenType::SEMICOLON)
                     ++Index;
-                break;
             }
-            case TokenType::IF: {
-                int line = t.line;
+            E.expect(Index, TokenType::END);
+            Node w = B.label(ASTType::WhileStatement, sv("while"), pos);
+            Node wb = B.label(ASTType::Block, sv("while_body"), pos);
+            B.attachIfAny(wb, Slot::Statements, body);
+            B.attachOne(w, Slot::Condition, cond);
+            B.attachOne(w, Slot::Body, wb);
+            Chunk.push_back(w);
+            break;
+        }
+        case TokenType::FUNCTION: {
+            uint32_t pos = t.offset;
+            ++Index;
+            sv funcName = "<anon>";
+            uint32_t funcSymbol = kNoSymbol;
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) == TokenType::IDENTIFIER) {
+                funcName = Tokens.text(Index);
+                funcSymbol = Tokens.symbol(Index);
                 ++Index;
-                AST cond = parseExpressionForwardDecl(Tokens, Index);
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::THEN)
+            } else {
+                E.missing(Index, TokenType::IDENTIFIER);
+            }
+            size_t params = B.mark();
+            if (E.expect(Index, TokenType::LEFT_PAREN)) {
+                while (Tokens.has(Index) &&
+                       Tokens.type(Index) != TokenType::RIGHT_PAREN) {
+                    if (Tokens.type(Index) == TokenType::IDENTIFIER) {
+                        B.push(makeName(Tokens, Index, B));
+                        ++Index;
+                        if (Tokens.has(Index) &&
+                            Tokens.type(Index) == TokenType::COMMA)
+                            ++Index;
+                    } else {
+                        E.skipParam(Index);
+                    }
+                }
+                E.expect(Index, TokenType::RIGHT_PAREN);
+            }
+            size_t body = B.mark();
+            while (Tokens.has(Index) &&
+                   Tokens.type(Index) != TokenType::END) {
+                if (Tokens.type(Index) == TokenType::RETURN) {
+                    uint32_t rpos = Tokens.offset(Index);
                     ++Index;
-                vector<AST> clauses;
-
-                // then block
-                vector<AST> thenBlock;
-                thenBlock.reserve(8);
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type != TokenType::ELSE &&
-                       Tokens[Index].type != TokenType::ELSEIF &&
-                       Tokens[Index].type != TokenType::END) {
-                    AST node = parseExpressionForwardDecl(Tokens, Index);
-                    thenBlock.push_back(move(node));
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::SEMICOLON)
+                    size_t retvals = B.mark();
+                    if (Tokens.has(Index) &&
+                        Tokens.type(Index) != TokenType::SEMICOLON)
+                        E.list(Index);
+                    Node rt = B.label(ASTType::ReturnStatement,
+                                      sv("return"), rpos);
+                    B.attachIfAny(rt, Slot::Values, retvals);
+                    B.push(rt);
+                    if (Tokens.has(Index) &&
+                        Tokens.type(Index) == TokenType::SEMICOLON)
                         ++Index;
-                    if (Index >= (int)Tokens.size()) break;
+                    continue;
                 }
-                AST ifcl = makeLeaf(ASTType::IfClause, sv("if"), line);
-                ifcl.children["condition"].push_back(move(cond));
-                AST thenblk = makeLeaf(ASTType::Block, sv("then"), line);
-                if (!thenBlock.empty())
-                    thenblk.children["statements"] = move(thenBlock);
-                ifcl.children["body"].push_back(move(thenblk));
-                clauses.push_back(move(ifcl));
-
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type == TokenType::ELSEIF) {
-                    int elifLine = Tokens[Index].line;
+                B.push(E.expression(Index));
+                if (Tokens.has(Index) &&
+                    Tokens.type(Index) == TokenType::SEMICOLON)
                     ++Index;
-                    AST elifCond = parseExpressionForwardDecl(Tokens, Index);
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::THEN)
+            }
+            E.expect(Index, TokenType::END);
+            Node fd =
+                B.label(ASTType::FunctionDeclaration, sv("function"), pos);
+            Node id = B.name(funcName, pos, funcSymbol);
+            Node blk = B.label(ASTType::Block, sv("body"), pos);
+            B.attachIfAny(blk, Slot::Statements, body);
+            B.attachIfAny(fd, Slot::Params, params);
+            B.attachOne(fd, Slot::Name, id);
+            B.attachOne(fd, Slot::Body, blk);
+            Chunk.push_back(fd);
+            break;
+        }
+        default: {
+            if (t.type == TokenType::IDENTIFIER) {
+                if (Tokens.has(Index + 1) &&
+                    (Tokens.type(Index + 1) == TokenType::EQUAL ||
+                     Tokens.type(Index + 1) == TokenType::COMMA)) {
+                    size_t vars = B.mark();
+                    while (Tokens.has(Index) &&
+                           Tokens.type(Index) == TokenType::IDENTIFIER) {
+                        B.push(makeName(Tokens, Index, B));
                         ++Index;
-                    vector<AST> elifBlock;
-                    while (Index < (int)Tokens.size() &&
-                           Tokens[Index].type != TokenType::ELSE &&
-                           Tokens[Index].type != TokenType::ELSEIF &&
-                           Tokens[Index].type != TokenType::END) {
-                        AST node = parseExpressionForwardDecl(Tokens, Index);
-                        elifBlock.push_back(move(node));
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::SEMICOLON)
+                        if (Tokens.has(Index) &&
+                            Tokens.type(Index) == TokenType::COMMA)
                             ++Index;
-                        if (Index >= (int)Tokens.size()) break;
+                        else
+                            break;
+                    }
+                    if (Tokens.has(Index) &&
+                        Tokens.type(Index) == TokenType::EQUAL) {
+                        ++Index;
+                        size_t vals = B.mark();
+                        E.list(Index);
+                        Node asn = B.label(ASTType::AssignmentStatement,
+                                          sv("assign"), t.offset);
+                        B.attachIfAny(asn, Slot::Values, vals);
+                        B.attachIfAny(asn, Slot::Variables, vars);
+                        Chunk.push_back(asn);
+                    } else {
+                        E.missing(Index, TokenType::EQUAL);
+                        B.drop(vars);
+                        Node expr =
+                            E.expression(Index);
+                        Node ch = B.label(ASTType::Chunk, sv("expr"),
+                                          B.offsetOf(expr));
+                        B.attachOne(ch, Slot::Statements, expr);
+                        Chunk.push_back(ch);
                     }
-                    AST elifcl =
-                        makeLeaf(ASTType::ElseifClause, sv("elseif"), elifLine);
-                    AST elifblk =
-                        makeLeaf(ASTType::Block, sv("elseif"), elifLine);
-                    if (!elifBlock.empty())
-                        elifblk.children["statements"] = move(elifBlock);
-                    elifcl.children["condition"].push_back(move(elifCond));
-                    elifcl.children["body"].push_back(move(elifblk));
-                    clauses.push_back(move(elifcl));
+                } else if (Tokens.has(Index + 1) &&
+                           Tokens.type(Index + 1) ==
+                               TokenType::LEFT_PAREN) {
+                    Node call = E.suffixed(Index);
+                    Node cs = B.label(ASTType::CallStatement,
+                                     sv("call_stmt"), t.offset);
+                    B.attachOne(cs, Slot::Expression, call);
+                    Chunk.push_back(cs);
+                } else {
+                    Node expr =
+                        E.expression(Index);
+                    Node ch =
+                        B.label(ASTType::Chunk, sv("expr"), B.offsetOf(expr));
+                    B.attachOne(ch, Slot::Statements, expr);
+                    Chunk.push_back(ch);
+                }
+            } else {
+                Node expr = E.expression(Index);
+                Node ch = B.label(ASTType::Chunk, sv("expr"), B.offsetOf(expr));
+                B.attachOne(ch, Slot::Statements, expr);
+                Chunk.push_back(ch);
+            }
+            if (Tokens.has(Index) &&
+                Tokens.type(Index) == TokenType::SEMICOLON)
+                ++Index;
+            break;
+        }
+    }  // end switch
+    return true;
+}
+
+// Appends top-level statements from Index to `tree` until the input ends
+// or, at a statement boundary, handOver(Index) returns true. Returns the
+// Index parsing stopped at.
+template <class Toks, class HandOver>
+int parseStatements(Toks& Tokens, int Index, ParseTree& tree,
+                    const ParseOptions& opts, HandOver&& handOver) {
+    AstBuilder B(tree.arena, bool(tree.source));
+    ExprParser<Toks> E(Tokens, B, opts, tree.error);
+    while (Tokens.has(Index) && !handOver(Index)) {
+        uint32_t first = uint32_t(Index);
+        size_t count = tree.statements.size();
+        size_t bytes = tree.arena.bytesUsed();
+        if (!parseStatement(Tokens, Index, B, E, tree.statements)) break;
+        if (tree.statements.size() > count)
+            tree.spans.push_back(StatementSpan{
+                first, uint32_t(Index),
+                uint32_t(tree.arena.bytesUsed() - bytes)});
+    }
+    return Index;
+}
+
+// Top-level parse. With a `source`, node text views it (and the tree pins
+// it) instead of being copied.
+template <class Toks>
+ParseTree parseChunk(Toks& Tokens, SourceRef source = nullptr,
+                     const ParseOptions& opts = ParseOptions()) {
+    ParseTree tree;
+    tree.source = move(source);
+    tree.statements.reserve(64);
+    parseStatements(Tokens, 0, tree, opts, [](int) { return false; });
+    return tree;
+}
+
+ParseTree Parse(const TokenStream& Tokens,
+                const ParseOptions& opts = ParseOptions()) {
+    return parseChunk(Tokens, nullptr, opts);
+}
+
+// View mode: no per-node text copies. `Tokens` must have been lexed from
+// `source`, which the returned tree keeps alive.
+ParseTree Parse(const TokenStream& Tokens, SourceRef source,
+                const ParseOptions& opts = ParseOptions()) {
+    assert(source && Tokens.base == source.data());
+    return parseChunk(Tokens, move(source), opts);
+}
+
+ParseTree Parse(const vector<Token>& Tokens,
+                const ParseOptions& opts = ParseOptions()) {
+    TokenVectorView view{Tokens};
+    return parseChunk(view, nullptr, opts);
+}
+
+ParseTree Parse(StreamingLexer& Tokens,
+                const ParseOptions& opts = ParseOptions()) {
+    return parseChunk(Tokens, nullptr, opts);
+}
+
+// ---------------- Validation ----------------
+// Syntax check without a tree: the statement and expression parsers run
+// over a Recognizer, so they make the same decisions as Parse() but
+// allocate nothing per node. The result is the first error, or none
+// exactly when Parse() with the same options would succeed.
+
+template <class Toks>
+ParseError recognize(Toks& Tokens, ParseOptions opts) {
+    ParseError error;
+    Recognizer B;
+    ExprParser<Toks, Recognizer> E(Tokens, B, opts, error);
+    vector<uint32_t> statement;  // parseStatement's output, unused
+    for (int Index = 0; Tokens.has(Index) && !error; statement.clear())
+        if (!parseStatement(Tokens, Index, B, E, statement)) break;
+    return error;
+}
+
+// Strict: reports what Parse() would have patched over.
+ParseError Validate(const TokenStream& Tokens,
+                    ParseOptions opts = ParseOptions()) {
+    opts.strict = true;
+    return recognize(Tokens, opts);
+}
+
+// Lexes as it goes, so no token arrays are built either.
+ParseError Validate(StreamingLexer& Tokens,
+                    ParseOptions opts = ParseOptions()) {
+    opts.strict = true;
+    return recognize(Tokens, opts);
+}
+
+// ---------------- Event parsing ----------------
+// SAX-style alternative to ParseTree: ParseEvents() reports each node to a
+// handler as nested beginNode / slot / endNode calls, in the order
+// printASTJson() visits them, and builds no tree. A handler is any class
+// with
+//     void beginNode(ASTType type, const NodeToken& token);
+//     void slot(Slot s);  // the nodes until the parent's next slot() or
+//                         // endNode() are children in slot `s`
+//     void endNode();
+// called directly, so it all inlines. Slots are reported the way JSON
+// prints them: present ones even when empty, absent ones not at all.
+//
+// The grammar builds bottom-up (a binary node only exists after its left
+// operand), so EventBuilder records each top-level statement into flat
+// buffers, replays it once it is complete and reuses the buffers for the
+// next one. The handler sees every statement as soon as it is parsed.
+
+struct NodeToken {
+    sv text;  // views the source the tokens came from, or a static label
+    uint32_t offset = kNoOffset;
+    uint32_t symbol = kNoSymbol;  // Identifier
+    LuaNumber number;             // NumericLiteral
+    LuaString str;                // StringLiteral
+};
+
+template <class Handler>
+class EventBuilder {
+   public:
+    using Node = uint32_t;  // index into `nodes`
+
+    explicit EventBuilder(Handler& h) : h(h) {}
+
+    Node label(ASTType t, sv text, uint32_t offset) {
+        Node n = Node(nodes.size());
+        nodes.push_back(Recorded{t, 0, offset, kNoSymbol,
+                                 uint32_t(ranges.size()), text});
+        ranges.resize(ranges.size() + kSlotLayouts.layouts[size_t(t)].count);
+        return n;
+    }
+    Node node(ASTType t, sv text, uint32_t offset) {
+        return label(t, text, offset);  // text is never copied
+    }
+    Node name(sv text, uint32_t offset, uint32_t symbol) {
+        Node n = label(ASTType::Identifier, text, offset);
+        nodes[n].aux = symbol;
+        return n;
+    }
+    Node number(sv text, uint32_t offset, LuaNumber value) {
+        Node n = label(ASTType::NumericLiteral, text, offset);
+        nodes[n].aux = uint32_t(numbers.size());
+        numbers.push_back(value);
+        return n;
+    }
+    Node str(sv text, uint32_t offset, LuaString value) {
+        Node n = label(ASTType::StringLiteral, text, offset);
+        nodes[n].strFlags = uint8_t(value.flags);
+        return n;
+    }
+    uint32_t offsetOf(Node n) const noexcept { return nodes[n].offset; }
+
+    size_t mark() const noexcept { return scratch.size(); }
+    void push(Node child) { scratch.push_back(child); }
+    void drop(size_t from) { scratch.resize(from); }
+    void attach(Node n, Slot s, size_t from) {
+        const SlotLayout& l = kSlotLayouts.layouts[size_t(nodes[n].type)];
+        uint8_t k = 0;
+        while (l.slots[k] != s) ++k;
+        ranges[nodes[n].ranges + k] =
+            Range{uint32_t(kids.size()), uint32_t(scratch.size() - from), 1};
+        kids.insert(kids.end(), scratch.begin() + from, scratch.end());
+        scratch.resize(from);
+    }
+    void attachIfAny(Node n, Slot s, size_t from) {
+        if (scratch.size() > from) attach(n, s, from);
+    }
+    void attachOne(Node n, Slot s, Node child) {
+        push(child);
+        attach(n, s, scratch.size() - 1);
+    }
+
+    // Reports the statement at `root`; with `last`, forgets everything
+    // recorded so far.
+    void emit(Node root, bool last) {
+        open(root);
+        while (!stack.empty()) {
+            Cursor& c = stack.back();
+            const Recorded& n = nodes[c.node];
+            const SlotLayout& l = kSlotLayouts.layouts[size_t(n.type)];
+            if (c.i == 0) {  // entering slot k: skip absent ones
+                while (c.k < l.count && !ranges[n.ranges + c.k].present)
+                    ++c.k;
+                if (c.k == l.count) {
+                    stack.pop_back();
+                    h.endNode();
+                    continue;
                 }
+                h.slot(l.slots[c.k]);
+            }
+            const Range& r = ranges[n.ranges + c.k];
+            if (c.i < r.count) {
+                open(kids[r.first + c.i++]);  // `c` is stale from here
+                continue;
+            }
+            ++c.k;
+            c.i = 0;
+        }
+        if (!last) return;
+        nodes.clear();
+        ranges.clear();
+        kids.clear();
+        numbers.clear();
+    }
+
+   private:
+    struct Recorded {
+        ASTType type;
+        uint8_t strFlags;  // StringLiteral: kStrLong / kStrDecode
+        uint32_t offset;
+        uint32_t aux;     // Identifier: symbol, NumericLiteral: numbers index
+        uint32_t ranges;  // first Range, one per slot of `type`
+        sv text;
+    };
+    struct Range {
+        uint32_t first = 0;  // into kids
+        uint32_t count = 0;
+        uint8_t present = 0;
+    };
+    struct Cursor {
+        Node node;
+        uint8_t k;   // slot being reported
+        uint32_t i;  // next child in it; 0: slot() not reported yet
+    };
+
+    void open(Node id) {
+        const Recorded& n = nodes[id];
+        NodeToken t;
+        t.text = n.text;
+        t.offset = n.offset;
+        if (n.type == ASTType::Identifier) t.symbol = n.aux;
+        if (n.type == ASTType::NumericLiteral) t.number = numbers[n.aux];
+        if (n.type == ASTType::StringLiteral)
+            t.str = LuaString(n.text, n.strFlags);
+        h.beginNode(n.type, t);
+        stack.push_back(Cursor{id, 0, 0});
+    }
+
+    Handler& h;
+    vector<Recorded> nodes;
+    vector<Range> ranges;
+    vector<Node> kids;
+    vector<LuaNumber> numbers;
+    vector<Node> scratch;
+    vector<Cursor> stack;
+};
+
+template <class Toks, class Handler>
+ParseError parseEvents(Toks& Tokens, Handler& h, const ParseOptions& opts) {
+    ParseError error;
+    EventBuilder<Handler> B(h);
+    ExprParser<Toks, EventBuilder<Handler>> E(Tokens, B, opts, error);
+    vector<uint32_t> statement;
+    for (int Index = 0; Tokens.has(Index); statement.clear()) {
+        if (!parseStatement(Tokens, Index, B, E, statement)) break;
+        for (size_t i = 0; i < statement.size(); ++i)
+            B.emit(statement[i], i + 1 == statement.size());
+    }
+    return error;
+}
+
+// Node text views the source `Tokens` was lexed from, which has to outlive
+// the handler's use of it. On error, the events end with the statement
+// that hit it, as ParseTree::statements would.
+template <class Handler>
+ParseError ParseEvents(const TokenStream& Tokens, Handler& h,
+                       const ParseOptions& opts = ParseOptions()) {
+    return parseEvents(Tokens, h, opts);
+}
+
+template <class Handler>
+ParseError ParseEvents(StreamingLexer& Tokens, Handler& h,
+                       const ParseOptions& opts = ParseOptions()) {
+    return parseEvents(Tokens, h, opts);
+}
+
+// The events ParseEvents() would report for `root`, from a tree already
+// built (e.g. Document::tree()). Iterative, like the replay above.
+template <class Handler>
+void emitEvents(const AST& root, Handler& h) {
+    struct Cursor {
+        const AST* node;
+        uint8_t k;
+        uint32_t i;
+    };
+    auto open = [&](const AST& n, vector<Cursor>& stack) {
+        h.beginNode(n.type, NodeToken{n.text, n.offset, n.symbol, n.number,
+                                      n.str()});
+        stack.push_back(Cursor{&n, 0, 0});
+    };
+    vector<Cursor> stack;
+    open(root, stack);
+    while (!stack.empty()) {
+        Cursor& c = stack.back();
+        const SlotLayout& l = c.node->layout();
+        if (c.i == 0) {
+            while (c.k < l.count && !c.node->slot(c.k).present) ++c.k;
+            if (c.k == l.count) {
+                stack.pop_back();
+                h.endNode();
+                continue;
+            }
+            h.slot(l.slots[c.k]);
+        }
+        const ChildList& group = c.node->slot(c.k);
+        if (c.i < group.count) {
+            open(group[c.i++], stack);
+            continue;
+        }
+        ++c.k;
+        c.i = 0;
+    }
+}
+
+// ---------------- Parallel parsing ----------------
+// The token stream is cut into ranges at guessed statement boundaries and
+// every range is parsed into its own tree concurrently, each stopping at
+// the first statement boundary at or past the next cut. A guess can be
+// wrong (it may sit inside a statement the real parse sees differently),
+// so the ranges are stitched in order: range i really starts where range
+// i-1 stopped. If that is its cut, all its statements stand. Otherwise it
+// is reparsed from the true position until that parse reaches the start
+// of one of its speculative statements, from where they are kept (as in
+// Document, top-level parsing depends on nothing but the token index), or
+// the next cut. The result is the tree Parse() builds.
+
+// Statement-start guesses for `n` ranges: for each even split, the first
+// token at or after it that follows a token which can end a statement,
+// outside any block, bracket or brace. One pass over the token types.
+static vector<size_t> statementCuts(const TokenStream& T, size_t n) {
+    auto ends = [](TokenType t) {
+        switch (t) {
+            case TokenType::END:
+            case TokenType::RIGHT_PAREN:
+            case TokenType::RIGHT_BRACE:
+            case TokenType::RIGHT_BRACKET:
+            case TokenType::IDENTIFIER:
+            case TokenType::NUMBER:
+            case TokenType::STRING:
+            case TokenType::TRUE_:
+            case TokenType::FALSE_:
+            case TokenType::NIL:
+            case TokenType::DOT_DOT_DOT:
+            case TokenType::SEMICOLON:
+                return true;
+            default:
+                return false;
+        }
+    };
+    auto starts = [](TokenType t) {
+        switch (t) {
+            case TokenType::IDENTIFIER:
+            case TokenType::LOCAL:
+            case TokenType::FUNCTION:
+            case TokenType::IF:
+            case TokenType::WHILE:
+            case TokenType::FOR:
+            case TokenType::DO:
+            case TokenType::REPEAT:
+            case TokenType::RETURN:
+                return true;
+            default:
+                return false;
+        }
+    };
+    vector<size_t> cuts{0};
+    size_t target = T.size() / n, depth = 0;
+    for (size_t k = 1; k < T.size() && cuts.size() < n; ++k) {
+        TokenType prev = T.types[k - 1], t = T.types[k];
+        switch (prev) {  // `while` / `for` blocks are counted at their `do`
+            case TokenType::FUNCTION:
+            case TokenType::IF:
+            case TokenType::DO:
+            case TokenType::REPEAT:
+            case TokenType::LEFT_PAREN:
+            case TokenType::LEFT_BRACE:
+            case TokenType::LEFT_BRACKET:
+                ++depth;
+                break;
+            case TokenType::END:
+            case TokenType::UNTIL:
+            case TokenType::RIGHT_PAREN:
+            case TokenType::RIGHT_BRACE:
+            case TokenType::RIGHT_BRACKET:
+                if (depth) --depth;
+                break;
+            default:
+                break;
+        }
+        if (k >= target && depth == 0 && ends(prev) && starts(t)) {
+            cuts.push_back(k);
+            target = max(k + 1, T.size() * cuts.size() / n);
+        }
+    }
+    cuts.push_back(T.size());
+    return cuts;
+}
+
+// Parse() on `threads` threads (0 = all cores). Streams too small to give
+// every range `minRangeTokens` use fewer ranges, down to the plain
+// sequential parse. With a `source`, the tree views it as in Parse().
+ParseTree ParseParallel(const TokenStream& Tokens,
+                        SourceRef source = nullptr,
+                        unsigned threads = 0,
+                        size_t minRangeTokens = 64 * 1024,
+                        const ParseOptions& opts = ParseOptions()) {
+    assert(!source || Tokens.base == source.data());
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    // a few ranges per thread, so uneven ones balance out
+    size_t n = min<size_t>(size_t(threads) * 4,
+                           Tokens.size() / max<size_t>(1, minRangeTokens));
+    if (threads == 1 || n <= 1) return parseChunk(Tokens, move(source), opts);
+
+    vector<size_t> cuts = statementCuts(Tokens, n);
+    n = cuts.size() - 1;
+    vector<ParseTree> parts(n);
+    vector<int> exits(n);
+    parallelForDynamic(n, threads, [&](size_t i) {
+        parts[i].source = source;
+        size_t next = cuts[i + 1];
+        exits[i] = parseStatements(
+            Tokens, int(cuts[i]), parts[i], opts,
+            [&](int at) { return i + 1 < n && size_t(at) >= next; });
+    });
+
+    // stitch in order
+    ParseTree tree;
+    tree.source = move(source);
+    auto append = [&](ParseTree& part, size_t from) {
+        tree.statements.insert(tree.statements.end(),
+                               part.statements.begin() + from,
+                               part.statements.end());
+        tree.spans.insert(tree.spans.end(), part.spans.begin() + from,
+                          part.spans.end());
+        tree.arena.adopt(move(part.arena));
+        tree.error = part.error;
+    };
+    int pos = 0;
+    for (size_t i = 0; i < n && !tree.error; ++i) {
+        ParseTree& part = parts[i];
+        if (size_t(pos) == cuts[i]) {
+            append(part, 0);
+            pos = exits[i];
+            continue;
+        }
+        size_t from = part.size();
+        ParseTree fix;
+        fix.source = tree.source;
+        pos = parseStatements(Tokens, pos, fix, opts, [&](int at) {
+            auto it = lower_bound(
+                part.spans.begin(), part.spans.end(), uint32_t(at),
+                [](const StatementSpan& s, uint32_t k) { return s.first < k; });
+            if (it != part.spans.end() && it->first == uint32_t(at)) {
+                from = size_t(it - part.spans.begin());
+                return true;
+            }
+            return i + 1 < n && size_t(at) >= cuts[i + 1];
+        });
+        append(fix, 0);
+        if (from < part.size() && !tree.error) {
+            append(part, from);
+            pos = exits[i];
+        }
+    }
+    return tree;
+}
+
+// ---------------- Incremental reparsing ----------------
+// A source with its tokens and tree, kept so that an edit only redoes the
+// work it touches. The edit is relexed from a token before it until the
+// lexer reproduces, past the edit, a token of the old stream at the
+// shifted offset; both lexers were then at the top of their loop at the
+// same byte, so the old tokens from there on are kept with moved offsets.
+//
+// Statements that never looked at a relexed token are kept as they are.
+// Parsing resumes after them and hands back to the old tree at the first
+// boundary of an old statement inside the kept tokens: top-level parsing
+// depends on nothing but the token index, so the rest would come out the
+// same. Those statements are kept as they are; moving their node offsets
+// is left to tree(), so a burst of edits between reads walks them once.
+//
+// The tree is parsed in copy mode, so no kept node views replaced text.
+// Dropped statements stay in the arena until they outweigh the live ones;
+// the edit after that parses from scratch, which compacts it.
+class Document {
+   public:
+    struct EditStats {
+        bool full = false;  // parsed from scratch
+        size_t relexedTokens = 0;
+        size_t reparsedStatements = 0;
+        size_t keptStatements = 0;
+    };
+
+    explicit Document(string text, const ParseOptions& opts = ParseOptions())
+        : text(make_unique<string>(move(text))), opts(opts) {
+        parseAll();
+    }
+
+    // Replaces bytes [offset, offset + removed) of the source with
+    // `inserted` and brings the tokens and tree up to date.
+    const EditStats& edit(uint32_t offset, uint32_t removed, sv inserted);
+
+    const string& source() const noexcept { return *text; }
+    const TokenStream& tokens() const noexcept { return toks; }
+    // settles node offsets that earlier edits left pending
+    const ParseTree& tree() {
+        if (lagging) settle();
+        return parsed;
+    }
+    const EditStats& lastEdit() const noexcept { return stats; }
+
+   private:
+    // lexLoop sink for relexing: stops once it reproduces an old token
+    struct ResyncSink {
+        TokenStream& out;
+        const TokenStream& old;
+        size_t editEnd;  // end of the inserted text
+        uint32_t shift;  // added to old offsets past the edit
+        size_t j;        // first old token not yet matched or passed
+        bool synced = false;
+
+        void push(TokenType t, size_t start, size_t length,
+                  uint32_t aux = 0) {
+            if (synced) return;  // same-iteration token; the kept tail has it
+            out.push(t, start, length, aux);
+            match(t, start, length);
+        }
+        void pushNumber(size_t start, size_t length, LuaNumber v) {
+            if (synced) return;
+            out.pushNumber(start, length, v);
+            match(TokenType::NUMBER, start, length);
+        }
+        void pushName(size_t start, size_t length) {
+            if (synced) return;
+            out.push(TokenType::IDENTIFIER, start, length,
+                     out.symbols->intern(sv(out.base + start, length)));
+            match(TokenType::IDENTIFIER, start, length);
+        }
+        void match(TokenType t, size_t start, size_t length) {
+            // string offsets aren't loop positions, and "--[" looks two
+            // bytes back
+            if (t == TokenType::STRING || start < editEnd + 2) return;
+            while (j < old.size() && uint32_t(old.offsets[j] + shift) < start)
+                ++j;
+            if (j < old.size() && uint32_t(old.offsets[j] + shift) == start &&
+                old.types[j] == t && old.lengths[j] == length) {
+                synced = true;
+                ++j;
+            }
+        }
+        bool full() const noexcept { return synced; }
+    };
+
+    // Tokens the lexer loop can be restarted from: STRING offsets sit past
+    // the opening quote.
+    static bool resumable(TokenType t) noexcept {
+        return t != TokenType::STRING;
+    }
+
+    void parseAll() {
+        toks = LexStreamParallel(*text);
+        parsed = Parse(toks, opts);
+        liveBytes = parsed.arena.bytesUsed();
+        lag.assign(parsed.size(), 0);
+        lagging = false;
+        stats = EditStats();
+        stats.full = true;
+        stats.relexedTokens = toks.size();
+        stats.reparsedStatements = parsed.size();
+    }
+    void relex(size_t from, ResyncSink& sink) const {
+        const char* d = text->data();
+        switch (bestScanLevel()) {
+#ifdef LUAP_X86
+            case ScanLevel::AVX2:
+                lexLoop<Avx2Scan>(d, text->size(), from, text->size(), sink);
+                return;
+            case ScanLevel::SSE2:
+                lexLoop<Sse2Scan>(d, text->size(), from, text->size(), sink);
+                return;
+#endif
+            default:
+                lexLoop<ScalarScan>(d, text->size(), from, text->size(),
+                                    sink);
+        }
+    }
+    void settle() {
+        for (size_t k = 0; k < parsed.size(); ++k) {
+            if (!lag[k]) continue;
+            pending.assign(1, parsed.statements[k]);
+            while (!pending.empty()) {
+                AST* n = pending.back();
+                pending.pop_back();
+                if (n->offset != kNoOffset) n->offset += lag[k];
+                uint8_t count = n->layout().count;
+                for (const ChildList* s = n->slots; s != n->slots + count; ++s)
+                    for (uint32_t i = 0; i < s->count; ++i)
+                        pending.push_back(s->items[i]);
+            }
+            lag[k] = 0;
+        }
+        lagging = false;
+    }
+
+    unique_ptr<string> text;  // on the heap so toks.base survives moves
+    ParseOptions opts;
+    TokenStream toks;
+    ParseTree parsed;
+    size_t liveBytes = 0;  // arena bytes of the statements in `parsed`
+    vector<uint32_t> lag;  // per statement: shift its node offsets still need
+    bool lagging = false;
+    EditStats stats;
+    vector<AST*> pending;
+};
+
+const Document::EditStats& Document::edit(uint32_t offset, uint32_t removed,
+                                          sv inserted) {
+    assert(offset <= text->size() && removed <= text->size() - offset);
+    text->replace(offset, removed, inserted.data(), inserted.size());
+    if (parsed.error ||
+        parsed.arena.bytesUsed() > 2 * liveBytes + 1024 * 1024) {
+        parseAll();
+        return stats;
+    }
+    stats = EditStats();
+    uint32_t shift = uint32_t(inserted.size()) - removed;  // mod 2^32
+    TokenStream& T = toks;
+    vector<StatementSpan>& spans = parsed.spans;
+    T.base = text->data();
+
+    // The token just before the edit may run into it. The first statement
+    // that looked at it is where reparsing starts.
+    size_t touched =
+        size_t(lower_bound(T.offsets.begin(), T.offsets.end(), offset) -
+               T.offsets.begin());
+    if (touched) --touched;
+    auto lookedBefore = [](const StatementSpan& s, size_t k) {
+        return s.end < k;
+    };
+    size_t i0 = size_t(
+        lower_bound(spans.begin(), spans.end(), touched, lookedBefore) -
+        spans.begin());
+    size_t k0 = touched;
+    if (i0 < spans.size()) k0 = min<size_t>(k0, spans[i0].first);
+    while (k0 > 0 && !resumable(T.types[k0])) --k0;
+
+    TokenStream fresh;
+    fresh.base = T.base;
+    fresh.symbols = T.symbols;
+    size_t pastEdit =
+        size_t(lower_bound(T.offsets.begin() + k0, T.offsets.end(),
+                           offset + removed) -
+               T.offsets.begin());
+    ResyncSink sink{fresh, T, offset + inserted.size(), shift, pastEdit};
+    relex(k0 ? T.offsets[k0] : 0, sink);
+    size_t keepFrom = sink.synced ? sink.j : T.size() - 1;  // or just EOF
+    T.splice(k0, keepFrom, fresh, shift);
+    T.lines.replace(T.base, offset, removed, uint32_t(inserted.size()));
+    stats.relexedTokens = fresh.size();
+    size_t tail = k0 + fresh.size();  // first kept token after the edit
+    uint32_t tokShift = uint32_t(tail - keepFrom);
+
+    // statements from i0 on are either reparsed or kept further down
+    vector<AST*> old(parsed.statements.begin() + i0, parsed.statements.end());
+    vector<StatementSpan> oldSpans(spans.begin() + i0, spans.end());
+    vector<uint32_t> oldLag(lag.begin() + i0, lag.end());
+    for (const StatementSpan& s : oldSpans) liveBytes -= s.bytes;
+    int Index = i0 ? int(spans[i0 - 1].end) : 0;
+    parsed.statements.resize(i0);
+    spans.resize(i0);
+    lag.resize(i0);
+
+    size_t keep = oldSpans.size();
+    auto handOver = [&](int at) {
+        if (size_t(at) < tail) return false;
+        uint32_t was = uint32_t(at) - tokShift;
+        auto it = lower_bound(
+            oldSpans.begin(), oldSpans.end(), was,
+            [](const StatementSpan& s, uint32_t k) { return s.first < k; });
+        if (it == oldSpans.end() || it->first != was) return false;
+        keep = size_t(it - oldSpans.begin());
+        return true;
+    };
+    size_t bytes = parsed.arena.bytesUsed();
+    parseStatements(T, Index, parsed, opts, handOver);
+    liveBytes += parsed.arena.bytesUsed() - bytes;
+    stats.reparsedStatements = parsed.size() - i0;
+    lag.resize(parsed.size(), 0);
+    if (parsed.error) return stats;
+
+    for (size_t k = keep; k < old.size(); ++k) {
+        StatementSpan s = oldSpans[k];
+        s.first += tokShift;
+        s.end += tokShift;
+        parsed.statements.push_back(old[k]);
+        spans.push_back(s);
+        lag.push_back(oldLag[k] + shift);
+        liveBytes += s.bytes;
+    }
+    lagging |= shift != 0;
+    stats.keptStatements = i0 + old.size() - keep;
+    return stats;
+}
+
+// ---------------- Flat AST ----------------
+// The same tree laid out as a handful of flat arrays linked by 32-bit
+// indices, so it can be copied, hashed or written out as plain buffers.
+// Nodes are stored in pre-order. Each one owns a run of FlatRange entries,
+// one per slot of its type, and each range covers part of `children`.
+
+enum : uint8_t {
+    kFlatSlotPresent = 1,  // bit k set: slot k is present
+    kFlatPooled = 1 << 3   // text is in FlatTree::strings, not the source
+};
+
+struct FlatNode {
+    ASTType type;
+    uint8_t flags;     // kFlatSlotPresent << k, kFlatPooled
+    uint8_t strFlags;  // StringLiteral: kStrLong / kStrDecode
+    uint8_t pad = 0;
+    uint32_t offset;     // source position, resolved through LineIndex
+    uint32_t textStart;  // into the source, or into strings if pooled
+    uint32_t textLen;
+    uint32_t aux;     // Identifier: symbol id, NumericLiteral: numbers index
+    uint32_t ranges;  // first FlatRange of this node
+};
+static_assert(sizeof(FlatNode) == 24, "FlatNode stays compact");
+
+struct FlatRange {
+    uint32_t first;  // into FlatTree::children
+    uint32_t count;
+};
+
+struct FlatTree;
+template <class Store> struct FlatChildrenOf;
+
+// Read-only view of one flat node with the members and accessors of AST,
+// so code written against AST (printASTJson, countNodes) works on both.
+// Literal values are looked up on request. Store is whatever holds the
+// arrays: a FlatTree in memory or a MappedAst over a binary file.
+template <class Store>
+struct FlatRefOf {
+    const Store* tree;
+    uint32_t index;
+    ASTType type;
+    uint32_t offset;
+    sv text;
+
+    static FlatRefOf at(const Store& s, uint32_t i) noexcept {
+        const FlatNode& n = s.flatNode(i);
+        return FlatRefOf{&s, i, n.type, n.offset, s.textOf(n)};
+    }
+    const SlotLayout& layout() const noexcept {
+        return kSlotLayouts.layouts[size_t(type)];
+    }
+    FlatChildrenOf<Store> slot(uint8_t k) const noexcept {
+        const FlatNode& n = tree->flatNode(index);
+        if (!(n.flags & (kFlatSlotPresent << k)))
+            return {tree, nullptr, 0, false};
+        const FlatRange& r = tree->range(n.ranges + k);
+        return {tree, tree->childIds() + r.first, r.count, true};
+    }
+    FlatChildrenOf<Store> children(Slot s) const noexcept {
+        const SlotLayout& l = layout();
+        for (uint8_t k = 0; k < l.count; ++k)
+            if (l.slots[k] == s) return slot(k);
+        return {};
+    }
+    uint32_t symbol() const noexcept {
+        const FlatNode& n = tree->flatNode(index);
+        return n.type == ASTType::Identifier ? tree->symbol(n) : kNoSymbol;
+    }
+    LuaNumber number() const noexcept {
+        const FlatNode& n = tree->flatNode(index);
+        return n.type == ASTType::NumericLiteral ? tree->number(n.aux)
+                                                 : LuaNumber{};
+    }
+    LuaString str() const noexcept {
+        return LuaString(text, tree->flatNode(index).strFlags);
+    }
+};
+
+template <class Store>
+struct FlatChildrenOf {
+    const Store* tree = nullptr;
+    const uint32_t* items = nullptr;
+    uint32_t count = 0;
+    bool present = false;
+
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    FlatRefOf<Store> operator[](size_t i) const noexcept {
+        return FlatRefOf<Store>::at(*tree, items[i]);
+    }
+};
+
+using FlatRef = FlatRefOf<FlatTree>;
+using FlatChildren = FlatChildrenOf<FlatTree>;
+
+struct FlatTree {
+    vector<FlatNode> nodes;
+    vector<FlatRange> ranges;
+    vector<uint32_t> children;
+    vector<uint32_t> roots;  // top-level statements
+    vector<LuaNumber> numbers;
+    string strings;                   // pooled text
+    SourceRef source;  // what unpooled text indexes
+
+    size_t size() const noexcept { return roots.size(); }
+    FlatRef operator[](size_t i) const noexcept { return node(roots[i]); }
+    FlatRef node(uint32_t i) const noexcept { return FlatRef::at(*this, i); }
+
+    // the store interface FlatRefOf reads through
+    const FlatNode& flatNode(uint32_t i) const noexcept { return nodes[i]; }
+    const FlatRange& range(uint32_t i) const noexcept { return ranges[i]; }
+    const uint32_t* childIds() const noexcept { return children.data(); }
+    LuaNumber number(uint32_t i) const noexcept { return numbers[i]; }
+    uint32_t symbol(const FlatNode& n) const noexcept { return n.aux; }
+    sv textOf(const FlatNode& n) const noexcept {
+        const char* base =
+            (n.flags & kFlatPooled) ? strings.data() : source.data();
+        return sv(base + n.textStart, n.textLen);
+    }
+
+    size_t bytesUsed() const noexcept {
+        return nodes.size() * sizeof(FlatNode) +
+               ranges.size() * sizeof(FlatRange) +
+               (children.size() + roots.size()) * sizeof(uint32_t) +
+               numbers.size() * sizeof(LuaNumber) + strings.size();
+    }
+};
+
+// Appends `n` itself; its slot ranges are filled in by flattenTree().
+static uint32_t flattenNode(const AST& n, FlatTree& out) {
+    uint32_t id = uint32_t(out.nodes.size());
+    FlatNode f{};
+    f.type = n.type;
+    f.offset = n.offset;
+    f.textLen = uint32_t(n.text.size());
+    f.aux = n.symbol;
+    const SourceRef& src = out.source;
+    if (src && n.text.data() >= src.data() &&
+        n.text.data() + n.text.size() <= src.data() + src.size()) {
+        f.textStart = uint32_t(n.text.data() - src.data());
+    } else {
+        f.flags |= kFlatPooled;
+        f.textStart = uint32_t(out.strings.size());
+        out.strings.append(n.text.data(), n.text.size());
+    }
+    if (n.type == ASTType::NumericLiteral) {
+        f.aux = uint32_t(out.numbers.size());
+        out.numbers.push_back(n.number);
+    } else if (n.type == ASTType::StringLiteral) {
+        f.strFlags = n.strFlags;
+    }
+    const SlotLayout& layout = n.layout();
+    f.ranges = uint32_t(out.ranges.size());
+    out.ranges.resize(out.ranges.size() + layout.count);
+    for (uint8_t k = 0; k < layout.count; ++k)
+        if (n.slots[k].present) f.flags |= kFlatSlotPresent << k;
+    out.nodes.push_back(f);
+    return id;
+}
+
+// Pre-order, with each slot's child range reserved just before its
+// subtrees. Iterative, so it also copes with very deep trees.
+static uint32_t flattenTree(const AST& root, FlatTree& out) {
+    struct Cursor {
+        const AST* node;
+        uint32_t id;
+        uint8_t k;
+        uint32_t i;
+        uint32_t first;  // children index of slot k's range
+    };
+    vector<Cursor> stack;
+    uint32_t rootId = flattenNode(root, out);
+    stack.push_back(Cursor{&root, rootId, 0, 0, 0});
+    while (!stack.empty()) {
+        Cursor& c = stack.back();
+        const SlotLayout& l = c.node->layout();
+        if (c.i == 0) {
+            while (c.k < l.count && !c.node->slots[c.k].present) ++c.k;
+            if (c.k == l.count) {
+                stack.pop_back();
+                continue;
+            }
+            uint32_t count = c.node->slots[c.k].count;
+            c.first = uint32_t(out.children.size());
+            out.ranges[out.nodes[c.id].ranges + c.k] =
+                FlatRange{c.first, count};
+            out.children.resize(c.first + count);
+        }
+        const ChildList& group = c.node->slots[c.k];
+        if (c.i < group.count) {
+            const AST& child = group[c.i];
+            uint32_t at = c.first + c.i++;
+            uint32_t id = flattenNode(child, out);  // `c` is still valid
+            out.children[at] = id;
+            stack.push_back(Cursor{&child, id, 0, 0, 0});
+            continue;
+        }
+        ++c.k;
+        c.i = 0;
+    }
+    return rootId;
+}
+
+// Copies `tree` into the flat layout. Text that points into the tree's
+// pinned source stays an offset into it; anything else is pooled.
+FlatTree Flatten(const ParseTree& tree) {
+    FlatTree out;
+    out.source = tree.source;
+    out.roots.reserve(tree.size());
+    for (size_t i = 0; i < tree.size(); ++i)
+        out.roots.push_back(flattenTree(tree[i], out));
+    return out;
+}
+
+// ---------------- Binary AST ----------------
+// A FlatTree saved as one file that is used in place: map it and the arrays
+// are already there, with nothing to parse or allocate per node. After the
+// header come these sections, each starting on an 8-byte boundary:
+//   nodes     FlatNode[]
+//   ranges    FlatRange[]
+//   children  uint32_t[]
+//   roots     uint32_t[]      top-level statements
+//   lines     uint32_t[]      LineIndex line starts
+//   numbers   BinaryNumber[]
+//   strings   pooled text
+//   source    the text unpooled nodes point into (empty if none is pinned)
+// Values are in host byte order; a file from a host of the other order
+// fails the byteOrder check. The version changes whenever FlatNode,
+// ASTType or the slot layouts do. Symbol ids only mean something to the
+// writer's SymbolTable, so Identifier nodes are saved with kNoSymbol.
+
+enum : uint32_t {
+    kBinaryNodes,
+    kBinaryRanges,
+    kBinaryChildren,
+    kBinaryRoots,
+    kBinaryLines,
+    kBinaryNumbers,
+    kBinaryStrings,
+    kBinarySource,
+    kBinarySections
+};
+
+static constexpr char kBinaryMagic[8] = {'L', 'U', 'A', 'P', 'A', 'S', 'T', 0};
+static constexpr uint32_t kBinaryVersion = 2;
+static constexpr uint32_t kBinaryByteOrder = 0x01020304;
+
+struct BinarySection {
+    uint64_t offset;  // from the start of the file
+    uint64_t bytes;
+};
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    BinarySection sections[kBinarySections];
+};
+
+// LuaNumber without the union's padding, so files are byte-reproducible
+struct BinaryNumber {
+    uint64_t bits;  // the int64 or the double's bit pattern
+    uint8_t kind;   // LuaNumber::Kind
+    uint8_t pad[7];
+};
+static_assert(sizeof(BinaryNumber) == 16, "BinaryNumber has no padding");
+
+static constexpr uint64_t binaryAlign(uint64_t n) noexcept {
+    return (n + 7) & ~uint64_t(7);
+}
+
+// Writes `tree` with the line table of its source; false if `out` failed.
+bool WriteBinaryAst(const FlatTree& tree, const LineIndex& lines,
+                    ostream& out) {
+    vector<uint32_t> starts(lines.lineCount());
+    for (size_t l = 0; l < starts.size(); ++l)
+        starts[l] = lines.lineStart(int(l) + 1);
+    vector<BinaryNumber> numbers(tree.numbers.size());
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        const LuaNumber& n = tree.numbers[i];
+        numbers[i] = BinaryNumber{};
+        numbers[i].kind = uint8_t(n.kind);
+        if (n.isFloat())
+            memcpy(&numbers[i].bits, &n.f, sizeof(double));
+        else
+            numbers[i].bits = uint64_t(n.i);
+    }
+    vector<FlatNode> nodes(tree.nodes);
+    for (FlatNode& n : nodes)
+        if (n.type == ASTType::Identifier) n.aux = kNoSymbol;
+    sv source = tree.source.text;
+
+    const void* data[kBinarySections] = {
+        nodes.data(),      tree.ranges.data(), tree.children.data(),
+        tree.roots.data(), starts.data(),      numbers.data(),
+        tree.strings.data(), source.data()};
+    BinaryHeader h{};
+    memcpy(h.magic, kBinaryMagic, sizeof(h.magic));
+    h.version = kBinaryVersion;
+    h.byteOrder = kBinaryByteOrder;
+    h.sections[kBinaryNodes].bytes = tree.nodes.size() * sizeof(FlatNode);
+    h.sections[kBinaryRanges].bytes = tree.ranges.size() * sizeof(FlatRange);
+    h.sections[kBinaryChildren].bytes = tree.children.size() * 4;
+    h.sections[kBinaryRoots].bytes = tree.roots.size() * 4;
+    h.sections[kBinaryLines].bytes = starts.size() * 4;
+    h.sections[kBinaryNumbers].bytes = numbers.size() * sizeof(BinaryNumber);
+    h.sections[kBinaryStrings].bytes = tree.strings.size();
+    h.sections[kBinarySource].bytes = source.size();
+    uint64_t at = binaryAlign(sizeof(BinaryHeader));
+    for (BinarySection& s : h.sections) {
+        s.offset = at;
+        at = binaryAlign(at + s.bytes);
+    }
+
+    static const char zeros[8] = {};
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    uint64_t written = sizeof(h);
+    for (uint32_t k = 0; k < kBinarySections; ++k) {
+        const BinarySection& s = h.sections[k];
+        out.write(zeros, streamsize(s.offset - written));
+        if (s.bytes)
+            out.write(static_cast<const char*>(data[k]), streamsize(s.bytes));
+        written = s.offset + s.bytes;
+    }
+    out.write(zeros, streamsize(binaryAlign(written) - written));
+    return bool(out);
+}
+
+// Straight from a parse result: flattens it, then writes that.
+bool WriteBinaryAst(const ParseTree& tree, const LineIndex& lines,
+                    ostream& out) {
+    return WriteBinaryAst(Flatten(tree), lines, out);
+}
+
+// whether `path` starts like a binary AST, of any version
+static bool isBinaryAst(const filesystem::path& path) {
+    char magic[sizeof(kBinaryMagic)] = {};
+    ifstream in(path, ios::binary);
+    in.read(magic, sizeof(magic));
+    return memcmp(magic, kBinaryMagic, sizeof(magic)) == 0;
+}
+
+// A binary AST file seen through the same FlatRefOf view as a FlatTree, so
+// printASTJson, writeChunkJson and countNodes take its nodes as they are.
+// open() checks the header and the section bounds; verify() also checks
+// every index, for files that may not come from WriteBinaryAst.
+class MappedAst {
+   public:
+    using Ref = FlatRefOf<MappedAst>;
+
+    // false if `path` can't be read or isn't a binary AST of this version
+    bool open(const filesystem::path& path) {
+        if (load(path)) return true;
+        close();
+        return false;
+    }
+    void close() noexcept {
+        file.close();
+        fill(begin(count), end(count), size_t(0));
+    }
+
+    // every index in bounds and every child after its parent
+    bool verify() const noexcept {
+        const FlatNode* nodes = at<FlatNode>(kBinaryNodes);
+        const uint32_t* kids = childIds();
+        for (size_t i = 0; i < count[kBinaryRoots]; ++i)
+            if (at<uint32_t>(kBinaryRoots)[i] >= count[kBinaryNodes])
+                return false;
+        for (uint32_t i = 0; i < count[kBinaryNodes]; ++i) {
+            const FlatNode& n = nodes[i];
+            if (size_t(n.type) >= kASTTypeCount) return false;
+            uint8_t slots = kSlotLayouts.layouts[size_t(n.type)].count;
+            size_t text = count[(n.flags & kFlatPooled) ? kBinaryStrings
+                                                       : kBinarySource];
+            if (n.textStart > text || n.textLen > text - n.textStart ||
+                size_t(n.ranges) + slots > count[kBinaryRanges] ||
+                (n.type == ASTType::NumericLiteral &&
+                 n.aux >= count[kBinaryNumbers]))
+                return false;
+            for (uint8_t k = 0; k < slots; ++k) {
+                if (!(n.flags & (kFlatSlotPresent << k))) continue;
+                const FlatRange& r = range(n.ranges + k);
+                if (r.first > count[kBinaryChildren] ||
+                    r.count > count[kBinaryChildren] - r.first)
+                    return false;
+                // pre-order: a child after its parent rules out cycles
+                for (uint32_t c = 0; c < r.count; ++c)
+                    if (kids[r.first + c] <= i ||
+                        kids[r.first + c] >= count[kBinaryNodes])
+                        return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size() const noexcept { return count[kBinaryRoots]; }
+    Ref operator[](size_t i) const noexcept {
+        return node(at<uint32_t>(kBinaryRoots)[i]);
+    }
+    Ref node(uint32_t i) const noexcept { return Ref::at(*this, i); }
+    size_t nodeCount() const noexcept { return count[kBinaryNodes]; }
+    size_t fileBytes() const noexcept { return file.size(); }
+    bool mapped() const noexcept { return file.mapped(); }
+    sv source() const noexcept {
+        return sv(base[kBinarySource], count[kBinarySource]);
+    }
+    // a copy of the line table, for LineIndex-based output
+    LineIndex lines() const {
+        const uint32_t* s = at<uint32_t>(kBinaryLines);
+        return LineIndex::fromStarts(
+            vector<uint32_t>(s, s + count[kBinaryLines]));
+    }
+
+    // the store interface FlatRefOf reads through
+    const FlatNode& flatNode(uint32_t i) const noexcept {
+        return at<FlatNode>(kBinaryNodes)[i];
+    }
+    const FlatRange& range(uint32_t i) const noexcept {
+        return at<FlatRange>(kBinaryRanges)[i];
+    }
+    const uint32_t* childIds() const noexcept {
+        return at<uint32_t>(kBinaryChildren);
+    }
+    LuaNumber number(uint32_t i) const noexcept {
+        const BinaryNumber& b = at<BinaryNumber>(kBinaryNumbers)[i];
+        if (b.kind == uint8_t(LuaNumber::Kind::Int))
+            return LuaNumber::integer(int64_t(b.bits));
+        if (b.kind != uint8_t(LuaNumber::Kind::Float)) return LuaNumber{};
+        double f;
+        memcpy(&f, &b.bits, sizeof(double));
+        return LuaNumber::real(f);
+    }
+    // ids belong to the writer's SymbolTable, which isn't saved
+    uint32_t symbol(const FlatNode&) const noexcept { return kNoSymbol; }
+    sv textOf(const FlatNode& n) const noexcept {
+        const char* text =
+            base[(n.flags & kFlatPooled) ? kBinaryStrings : kBinarySource];
+        return sv(text + n.textStart, n.textLen);
+    }
+
+   private:
+    bool load(const filesystem::path& path) {
+        if (!file.open(path) || file.size() < sizeof(BinaryHeader))
+            return false;
+        const auto& h = *reinterpret_cast<const BinaryHeader*>(file.data());
+        if (memcmp(h.magic, kBinaryMagic, sizeof(h.magic)) != 0 ||
+            h.byteOrder != kBinaryByteOrder || h.version != kBinaryVersion)
+            return false;
+        static constexpr size_t kItem[kBinarySections] = {
+            sizeof(FlatNode), sizeof(FlatRange), 4, 4, 4,
+            sizeof(BinaryNumber), 1, 1};
+        for (uint32_t k = 0; k < kBinarySections; ++k) {
+            const BinarySection& s = h.sections[k];
+            if (s.offset % 8 || s.offset > file.size() ||
+                s.bytes > file.size() - s.offset || s.bytes % kItem[k])
+                return false;
+            base[k] = file.data() + s.offset;
+            count[k] = size_t(s.bytes / kItem[k]);
+        }
+        return count[kBinaryLines] != 0 && at<uint32_t>(kBinaryLines)[0] == 0;
+    }
+    template <class T>
+    const T* at(uint32_t k) const noexcept {
+        return reinterpret_cast<const T*>(base[k]);
+    }
+
+    MappedFile file;
+    const char* base[kBinarySections] = {};
+    size_t count[kBinarySections] = {};
+};
+
+// ---------- Test helpers / main ----------
+
+// iterative, so it also copes with very deep trees
+template <class Node>
+static size_t countNodes(const Node& root) {
+    size_t n = 0;
+    vector<Node> pending{root};
+    while (!pending.empty()) {
+        Node node = pending.back();
+        pending.pop_back();
+        ++n;
+        for (uint8_t k = 0; k < node.layout().count; ++k) {
+            auto group = node.slot(k);
+            for (size_t i = 0; i < group.size(); ++i)
+                pending.push_back(group[i]);
+        }
+    }
+    return n;
+}
+
+static sv astTypeToString(ASTType type) noexcept {
+    switch (type) {
+        case ASTType::AssignmentStatement:
+            return "AssignmentStatement";
+        case ASTType::LocalStatement:
+            return "LocalStatement";
+        case ASTType::Identifier:
+            return "Identifier";
+        case ASTType::BooleanLiteral:
+            return "BooleanLiteral";
+        case ASTType::StringLiteral:
+            return "StringLiteral";
+        case ASTType::NumericLiteral:
+            return "NumericLiteral";
+        case ASTType::FunctionDeclaration:
+            return "FunctionDeclaration";
+        case ASTType::FunctionExpression:
+            return "FunctionExpression";
+        case ASTType::CallStatement:
+            return "CallStatement";
+        case ASTType::CallExpression:
+            return "CallExpression";
+        case ASTType::BinaryExpression:
+            return "BinaryExpression";
+        case ASTType::ReturnStatement:
+            return "ReturnStatement";
+        case ASTType::DoStatement:
+            return "DoStatement";
+        case ASTType::WhileStatement:
+            return "WhileStatement";
+        case ASTType::TableConstructorExpression:
+            return "TableConstructorExpression";
+        case ASTType::TableValue:
+            return "TableValue";
+        case ASTType::TableKey:
+            return "TableKey";
+        case ASTType::MemberExpression:
+            return "MemberExpression";
+        case ASTType::UnaryExpression:
+            return "UnaryExpression";
+        case ASTType::IndexExpression:
+            return "IndexExpression";
+        case ASTType::ForGenericStatement:
+            return "ForGenericStatement";
+        case ASTType::ForNumericStatement:
+            return "ForNumericStatement";
+        case ASTType::IfStatement:
+            return "IfStatement";
+        case ASTType::IfClause:
+            return "IfClause";
+        case ASTType::ElseifClause:
+            return "ElseifClause";
+        case ASTType::ElseClause:
+            return "ElseClause";
+        case ASTType::BreakStatement:
+            return "BreakStatement";
+        case ASTType::GotoStatement:
+            return "GotoStatement";
+        case ASTType::LabelStatement:
+            return "LabelStatement";
+        case ASTType::RepeatStatement:
+            return "RepeatStatement";
+        case ASTType::VarargLiteral:
+            return "VarargLiteral";
+        case ASTType::NilLiteral:
+            return "NilLiteral";
+        case ASTType::Chunk:
+            return "Chunk";
+        case ASTType::Block:
+            return "Block";
+        case ASTType::VariableAttribute:
+            return "VariableAttribute";
+        case ASTType::LogicalExpression:
+            return "LogicalExpression";
+        case ASTType::TableKeyString:
+            return "TableKeyString";
+        default:
+            return "Unknown";
+    }
+}
+
+// ---------------- JSON serializer ----------------
+// Output is appended to one reusable buffer and handed to the sink in big
+// pieces: fwrite() on a FILE*, write() on an ostream, or nothing, in which
+// case the caller reads data(). Strings are escaped by copying the runs
+// between bytes that need it, which jsonPlain() finds 16 at a time.
+
+#ifdef LUAP_X86
+using JsonScan = Sse2Scan;  // names and literals are short; no AVX2 here
+#else
+using JsonScan = ScalarScan;
+#endif
+
+class JsonWriter {
+   public:
+    static constexpr size_t kFlushBytes = 1 << 20;
+
+    JsonWriter() = default;
+    explicit JsonWriter(FILE* file) : file(file) {}
+    explicit JsonWriter(ostream& out) : out(&out) {}
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+    ~JsonWriter() { flush(); }
+
+    void raw(sv s) { buf.append(s.data(), s.size()); }
+    void raw(char c) { buf.push_back(c); }
+    void spaces(size_t n) { buf.append(n, ' '); }
+    void number(uint64_t v) {
+        char tmp[20];
+        buf.append(tmp, size_t(to_chars(tmp, tmp + 20, v).ptr - tmp));
+    }
+    // `s` escaped, without the quotes
+    void str(sv s) {
+        const char* d = s.data();
+        size_t i = 0, n = s.size();
+        while (i < n) {
+            size_t j = JsonScan::jsonPlain(d, i, n);
+            buf.append(d + i, j - i);
+            if (j == n) break;
+            escape((unsigned char)d[j]);
+            i = j + 1;
+        }
+    }
+    void quoted(sv s) {
+        buf.push_back('"');
+        str(s);
+        buf.push_back('"');
+    }
+
+    // Passes the buffer on once it is worth a call; cheap to call often.
+    void maybeFlush() {
+        if (buf.size() >= kFlushBytes) flush();
+    }
+    void flush() {
+        if (buf.empty() || (!file && !out)) return;
+        if (file)
+            fwrite(buf.data(), 1, buf.size(), file);
+        else
+            out->write(buf.data(), streamsize(buf.size()));
+        buf.clear();
+    }
+
+    const string& data() const noexcept { return buf; }
+    void clear() noexcept { buf.clear(); }
+    // hands over what is buffered, leaving the writer empty
+    string take() noexcept {
+        string out;
+        out.swap(buf);
+        return out;
+    }
+
+   private:
+    void escape(unsigned char c) {
+        switch (c) {
+            case '"': return raw("\\\"");
+            case '\\': return raw("\\\\");
+            case '\b': return raw("\\b");
+            case '\f': return raw("\\f");
+            case '\n': return raw("\\n");
+            case '\r': return raw("\\r");
+            case '\t': return raw("\\t");
+            default: {
+                char u[6] = {'\\', 'u', '0', '0', hexDigit(c >> 4),
+                             hexDigit(c & 0xF)};
+                buf.append(u, 6);
+            }
+        }
+    }
+
+    string buf;
+    FILE* file = nullptr;
+    ostream* out = nullptr;
+};
+
+// LineIndex::line() for offsets that mostly come in source order, as they
+// do in a pre-order walk: the previous line and the one after it are tried
+// before searching.
+class LineCursor {
+   public:
+    explicit LineCursor(const LineIndex& lines) : lines(lines) {}
+
+    int line(uint32_t offset) noexcept {
+        if (offset == kNoOffset) return 0;
+        if (offset < lo || offset >= hi) {
+            if (offset >= hi && hi != 0 && next(cur + 1) > offset)
+                ++cur;
+            else
+                cur = lines.line(offset);
+            lo = lines.lineStart(cur);
+            hi = next(cur);
+        }
+        return cur;
+    }
+
+   private:
+    // start of the line after `l`, or past any offset for the last one
+    uint32_t next(int l) const noexcept {
+        return size_t(l) < lines.lineCount() ? lines.lineStart(l + 1)
+                                             : kNoOffset;
+    }
+
+    const LineIndex& lines;
+    int cur = 0;
+    uint32_t lo = 0, hi = 0;  // offsets on line `cur`
+};
+
+// What a tree walk keeps on its stack for a node: AST nodes by address,
+// FlatRefs (already handles) by value.
+inline const AST* holdNode(const AST& n) noexcept { return &n; }
+inline const AST& heldNode(const AST* n) noexcept { return *n; }
+template <class Store>
+FlatRefOf<Store> holdNode(const FlatRefOf<Store>& n) noexcept { return n; }
+template <class Store>
+const FlatRefOf<Store>& heldNode(const FlatRefOf<Store>& n) noexcept {
+    return n;
+}
+
+// Pretty output puts every key on its own line, nested `indent` + 2 per
+// level; compact output has no whitespace at all. Works on AST and FlatRef
+// alike, and walks with an explicit stack, so tree depth is not bounded
+// by the native one. `w` is flushed as it fills, not once per tree.
+template <class Node>
+void writeASTJson(const Node& root, LineCursor& lines, JsonWriter& w,
+                  int indent = 0, bool compact = false) {
+    using Held = decltype(holdNode(root));
+    struct Cursor {
+        Held node;
+        int indent;
+        uint8_t k;
+        uint32_t i;
+        bool firstGroup;
+    };
+    vector<Cursor> stack;
+    auto close = [&](int at, bool anySlot) {
+        if (compact) {
+            w.raw("}}");
+        } else {
+            if (anySlot) {
+                w.raw('\n');
+                w.spaces(size_t(at) + 2);
+            }
+            w.raw("}\n");
+            w.spaces(size_t(at));
+            w.raw('}');
+        }
+        w.maybeFlush();
+    };
+    // leaves are written whole; other nodes stay on the stack until done
+    auto open = [&](const Node& node, int at) {
+        w.maybeFlush();
+        if (compact) {
+            w.raw("{\"nodeType\":\"");
+            w.raw(astTypeToString(node.type));
+            w.raw("\",\"text\":");
+            w.quoted(node.text);
+            w.raw(",\"line\":");
+            w.number(uint64_t(lines.line(node.offset)));
+            w.raw(",\"children\":{");
+        } else {
+            w.spaces(size_t(at));
+            w.raw("{\n");
+            w.spaces(size_t(at));
+            w.raw("  \"nodeType\": \"");
+            w.raw(astTypeToString(node.type));
+            w.raw("\",\n");
+            w.spaces(size_t(at));
+            w.raw("  \"text\": ");
+            w.quoted(node.text);
+            w.raw(",\n");
+            w.spaces(size_t(at));
+            w.raw("  \"line\": ");
+            w.number(uint64_t(lines.line(node.offset)));
+            w.raw(",\n");
+            w.spaces(size_t(at));
+            w.raw("  \"children\": {");
+        }
+        uint8_t k = 0, count = node.layout().count;
+        while (k < count && !node.slot(k).present) ++k;
+        if (k == count) return close(at, false);
+        stack.push_back(Cursor{holdNode(node), at, k, 0, true});
+    };
+
+    open(root, indent);
+    while (!stack.empty()) {
+        Cursor& c = stack.back();
+        const Node& node = heldNode(c.node);
+        const SlotLayout& layout = node.layout();
+        if (c.i == 0) {
+            while (c.k < layout.count && !node.slot(c.k).present) ++c.k;
+            if (c.k == layout.count) {
+                close(c.indent, !c.firstGroup);
+                stack.pop_back();
+                continue;
+            }
+            if (compact) {
+                if (!c.firstGroup) w.raw(',');
+                w.quoted(slotName(layout.slots[c.k]));
+                w.raw(":[");
+            } else {
+                w.raw(c.firstGroup ? "\n" : ",\n");
+                w.spaces(size_t(c.indent) + 4);
+                w.quoted(slotName(layout.slots[c.k]));
+                w.raw(": [\n");
+            }
+            c.firstGroup = false;
+        }
+        const auto& group = node.slot(c.k);
+        if (c.i < group.size()) {
+            if (c.i > 0) w.raw(compact ? "," : ",\n");
+            int at = c.indent + 6;
+            open(group[c.i++], at);  // `c` is not used past this point
+            continue;
+        }
+        if (!compact) {
+            if (c.i > 0) w.raw('\n');
+            w.spaces(size_t(c.indent) + 4);
+        }
+        w.raw(']');
+        ++c.k;
+        c.i = 0;
+    }
+}
+
+// Top-level statements as a JSON array; nested lines are indented by
+// `indent` + 2 and the closing bracket by `indent`, without a newline.
+template <class Tree>
+void writeChunkJson(const Tree& chunk, const LineIndex& index, JsonWriter& w,
+                    int indent = 0, bool compact = false) {
+    LineCursor lines(index);
+    w.raw(compact ? "[" : "[\n");
+    for (size_t i = 0; i < chunk.size(); ++i) {
+        writeASTJson(chunk[i], lines, w, indent + 2, compact);
+        if (i + 1 < chunk.size()) w.raw(',');
+        if (!compact) w.raw('\n');
+    }
+    if (!compact) w.spaces(size_t(indent));
+    w.raw(']');
+}
+
+// writeChunkJson() on `threads` threads (0 = all cores). The statements are
+// cut into blocks of about `minBlockBytes` of source, which workers claim in
+// turn and write into their own buffers; each block goes to `w` as soon as
+// it and all before it are done, separators included, so the text is
+// byte-identical. Workers stay at most a few blocks per thread ahead of
+// `w`, and one that holds more than a few JsonWriter::kFlushBytes of a
+// block waits until the blocks before it are out, then writes the rest of
+// it straight to `w`, statement by statement. Inputs too small for two
+// blocks use the plain writer.
+template <class Tree>
+void writeChunkJsonParallel(const Tree& chunk, const LineIndex& index,
+                            JsonWriter& w, int indent = 0,
+                            bool compact = false, unsigned threads = 0,
+                            size_t minBlockBytes = 64 * 1024) {
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    size_t n = chunk.size();
+    uint32_t first = n ? chunk[0].offset : 0;
+    uint32_t last = n ? chunk[n - 1].offset : 0;
+    size_t span = first < last && last != kNoOffset ? last - first : 0;
+    size_t blocks = min(n, span / max<size_t>(1, minBlockBytes));
+    if (threads == 1 || blocks <= 1)
+        return writeChunkJson(chunk, index, w, indent, compact);
+
+    struct Order {
+        JsonWriter& w;
+        mutex lock;
+        condition_variable moved;  // `written` advanced
+        size_t written = 0;        // blocks
+    } order{w, {}, {}, 0};
+    // Where a worker's buffer goes when it fills: block `b`'s text is held
+    // until every block before it is written, then goes straight to `w`,
+    // which nothing else writes to until `b` is done. Holding more than
+    // `cap` bytes waits for that turn.
+    struct Spill : streambuf {
+        Spill(Order& order, size_t cap) : order(order), cap(cap) {}
+
+        streamsize xsputn(const char* s, streamsize n) override {
+            if (!live) {
+                unique_lock<mutex> guard(order.lock);
+                live = order.written == b;
+                if (!live && held.size() + size_t(n) <= cap) {
+                    held.append(s, size_t(n));
+                    return n;
+                }
+                order.moved.wait(guard, [&] { return order.written == b; });
+                live = true;
+            }
+            order.w.raw(held);
+            held.clear();
+            order.w.raw(sv(s, size_t(n)));
+            order.w.maybeFlush();
+            return n;
+        }
+        int_type overflow(int_type c) override {
+            if (c == traits_type::eof()) return traits_type::not_eof(c);
+            char ch = char(c);
+            xsputn(&ch, 1);
+            return c;
+        }
+
+        Order& order;
+        size_t cap;
+        size_t b = 0;
+        bool live = false;  // block `b` is next: its text goes to `w`
+        string held;
+    };
+
+    size_t ahead = size_t(threads) * 4;
+    size_t cap = JsonWriter::kFlushBytes * 4;
+    vector<string> done(blocks);
+    vector<char> ready(blocks);
+    atomic<size_t> next{0};
+    w.raw(compact ? "[" : "[\n");
+    parallelFor(min<size_t>(threads, blocks), [&](size_t) {
+        Spill spill(order, cap);
+        ostream sink(&spill);
+        JsonWriter buf(sink);
+        LineCursor lines(index);
+        for (size_t b; (b = next.fetch_add(1)) < blocks;) {
+            {
+                unique_lock<mutex> guard(order.lock);
+                order.moved.wait(guard,
+                                 [&] { return b < order.written + ahead; });
+            }
+            spill.b = b;
+            for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; ++i) {
+                writeASTJson(chunk[i], lines, buf, indent + 2, compact);
+                if (i + 1 < n) buf.raw(',');
+                if (!compact) buf.raw('\n');
+                if (spill.live) buf.flush();
+            }
+            if (!spill.held.empty()) buf.flush();
+            lock_guard<mutex> guard(order.lock);
+            if (spill.live)
+                spill.live = false;  // all of it is in `w` already
+            else if (spill.held.empty())
+                done[b] = buf.take();
+            else
+                done[b].swap(spill.held);
+            ready[b] = 1;
+            // whoever completes the oldest pending block writes the run
+            for (; order.written < blocks && ready[order.written];
+                 ++order.written) {
+                w.raw(done[order.written]);
+                string().swap(done[order.written]);
+                w.maybeFlush();
+            }
+            order.moved.notify_all();
+        }
+    });
+    if (!compact) w.spaces(size_t(indent));
+    w.raw(']');
+}
+
+// writeChunkJson() as an event handler, for ParseEvents(): the same text,
+// written while the source is parsed. A node's key lines go out at
+// beginNode(); separators are written before the next sibling rather than
+// after the previous one, as events don't say which child is the last.
+class JsonEventWriter {
+   public:
+    JsonEventWriter(const LineIndex& lines, JsonWriter& w, int indent = 0,
+                    bool compact = false)
+        : lines(lines), w(w), indent(indent), compact(compact) {
+        w.raw(compact ? "[" : "[\n");
+    }
+
+    void beginNode(ASTType type, const NodeToken& t) {
+        w.maybeFlush();
+        int at = stack.empty() ? indent + 2 : stack.back().indent + 6;
+        uint32_t& siblings = stack.empty() ? statements : stack.back().kids;
+        if (siblings++) w.raw(compact ? "," : ",\n");
+        stack.push_back(Frame{at, 0, false, false});
+        if (compact) {
+            w.raw("{\"nodeType\":\"");
+            w.raw(astTypeToString(type));
+            w.raw("\",\"text\":");
+            w.quoted(t.text);
+            w.raw(",\"line\":");
+            w.number(uint64_t(lines.line(t.offset)));
+            w.raw(",\"children\":{");
+            return;
+        }
+        w.spaces(size_t(at));
+        w.raw("{\n");
+        w.spaces(size_t(at));
+        w.raw("  \"nodeType\": \"");
+        w.raw(astTypeToString(type));
+        w.raw("\",\n");
+        w.spaces(size_t(at));
+        w.raw("  \"text\": ");
+        w.quoted(t.text);
+        w.raw(",\n");
+        w.spaces(size_t(at));
+        w.raw("  \"line\": ");
+        w.number(uint64_t(lines.line(t.offset)));
+        w.raw(",\n");
+        w.spaces(size_t(at));
+        w.raw("  \"children\": {");
+    }
+    void slot(Slot s) {
+        Frame& f = stack.back();
+        closeSlot(f);
+        if (compact) {
+            if (f.anySlot) w.raw(',');
+            w.quoted(slotName(s));
+            w.raw(":[");
+        } else {
+            w.raw(f.anySlot ? ",\n" : "\n");
+            w.spaces(size_t(f.indent) + 4);
+            w.quoted(slotName(s));
+            w.raw(": [\n");
+        }
+        f.anySlot = f.open = true;
+        f.kids = 0;
+    }
+    void endNode() {
+        Frame& f = stack.back();
+        closeSlot(f);
+        if (compact) {
+            w.raw("}}");
+        } else {
+            if (f.anySlot) {
+                w.raw('\n');
+                w.spaces(size_t(f.indent) + 2);
+            }
+            w.raw("}\n");
+            w.spaces(size_t(f.indent));
+            w.raw('}');
+        }
+        stack.pop_back();
+        w.maybeFlush();
+    }
+
+    // closes the array once the events are over
+    void finish() {
+        if (!compact) {
+            if (statements) w.raw('\n');
+            w.spaces(size_t(indent));
+        }
+        w.raw(']');
+    }
+
+   private:
+    struct Frame {
+        int indent;
+        uint32_t kids;  // in the open slot so far
+        bool anySlot;
+        bool open;
+    };
+
+    void closeSlot(Frame& f) {
+        if (!f.open) return;
+        if (!compact) {
+            if (f.kids) w.raw('\n');
+            w.spaces(size_t(f.indent) + 4);
+        }
+        w.raw(']');
+        f.open = false;
+    }
+
+    LineCursor lines;
+    JsonWriter& w;
+    int indent;
+    bool compact;
+    uint32_t statements = 0;
+    vector<Frame> stack;
+};
+
+// Parses `code` and writes its JSON node by node, as the parser reaches
+// them, instead of building the tree first: the same text as
+// writeChunkJson(). Output is passed on every JsonWriter::kFlushBytes, even
+// inside a statement, so memory is the source, `lines` (its LineIndex) and
+// a frame per open node. On error the output ends with the statement that
+// hit it and is still a closed array.
+ParseError StreamChunkJson(sv code, const LineIndex& lines,
+                           JsonWriter& w, int indent = 0,
+                           bool compact = false,
+                           SymbolTable& symbols = globalSymbols()) {
+    StreamingLexer tokens(code, bestScanLevel(), symbols);
+    JsonEventWriter out(lines, w, indent, compact);
+    ParseError error = ParseEvents(tokens, out);
+    out.finish();
+    return error;
+}
+
+// ostream conveniences; the writer flushes into `out` when it goes
+template <class Node>
+void printASTJson(const Node& node, const LineIndex& lines, ostream& out,
+                  int indent = 0) {
+    JsonWriter w(out);
+    LineCursor cursor(lines);
+    writeASTJson(node, cursor, w, indent);
+}
+
+template <class Tree>
+void printChunkJson(const Tree& chunk, const LineIndex& lines, ostream& out,
+                    int indent = 0) {
+    JsonWriter w(out);
+    writeChunkJson(chunk, lines, w, indent);
+}
+
+// ---------------- Parse cache ----------------
+// An opt-in directory of finished outputs (JSON, binary ASTs, check
+// verdicts), one file per entry, named by a hash of the source seeded with
+// the output version and variant, so an unchanged file skips lexing,
+// parsing and serializing. Entries are written under a temporary name and
+// renamed into place, so a reader sees a whole entry or none, from this
+// process or another. A hit refreshes the entry's modification time, and
+// once the directory outgrows its limit the least recently used entries
+// are removed.
+
+// Bump whenever any input's output changes: it is part of every key.
+static constexpr uint32_t kOutputVersion = 3;
+
+// a * b as 128 bits: low half into a, high half into b
+static inline void mul128(uint64_t& a, uint64_t& b) noexcept {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)a * b;
+    a = uint64_t(r);
+    b = uint64_t(r >> 64);
+#elif defined(_MSC_VER) && defined(LUAP_X86)
+    a = _umul128(a, b, &b);
+#else
+    uint64_t al = uint32_t(a), ah = a >> 32, bl = uint32_t(b), bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + uint32_t(lh) + uint32_t(hl);
+    a = uint32_t(ll) | (mid << 32);
+    b = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+static inline uint64_t mulFold(uint64_t a, uint64_t b) noexcept {
+    mul128(a, b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const unsigned char* p) noexcept {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+static inline uint64_t read32(const unsigned char* p) noexcept {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// wyhash-style: 48 bytes per round in three independent multiply lanes.
+// Reads in host byte order, so values are only comparable on one host.
+static uint64_t hashBytes(sv s, uint64_t seed = 0) noexcept {
+    static constexpr uint64_t k[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+        0x4d5a2da51de1aa47ull};
+    auto p = reinterpret_cast<const unsigned char*>(s.data());
+    size_t len = s.size(), i = len;
+    uint64_t a = 0, b = 0;
+    seed ^= mulFold(seed ^ k[0], k[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t q = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + q);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - q);
+        } else if (len > 0) {
+            a = (uint64_t(p[0]) << 16) | (uint64_t(p[len >> 1]) << 8) |
+                p[len - 1];
+        }
+    } else {
+        if (i > 48) {
+            uint64_t lane1 = seed, lane2 = seed;
+            do {
+                seed = mulFold(read64(p) ^ k[1], read64(p + 8) ^ seed);
+                lane1 = mulFold(read64(p + 16) ^ k[2], read64(p + 24) ^ lane1);
+                lane2 = mulFold(read64(p + 32) ^ k[3], read64(p + 40) ^ lane2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        for (; i > 16; i -= 16, p += 16)
+            seed = mulFold(read64(p) ^ k[1], read64(p + 8) ^ seed);
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    a ^= k[1];
+    b ^= seed;
+    mul128(a, b);
+    return mulFold(a ^ k[0] ^ len, b ^ k[1]);
+}
+
+// Precedes the output in every entry file.
+struct CacheEntryHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t bytes;  // of output after the header
+    uint64_t check;  // hashBytes(output, key): catches torn or bad files
+};
+
+static constexpr char kCacheMagic[8] = {'L', 'U', 'A', 'P', 'C', 'C', 'H', 0};
+
+class ParseCache {
+   public:
+    struct Stats {
+        size_t hits, misses, writes, evictions;
+        uint64_t bytes;  // in the directory, as last counted
+    };
+
+    ParseCache(filesystem::path dir, uint64_t maxBytes)
+        : dir(move(dir)), maxBytes(maxBytes) {
+        random_device seed;
+        serial = uint64_t(seed()) << 32 | seed();
+        error_code ec;
+        filesystem::create_directories(this->dir, ec);
+        bytes = scan(nullptr);
+        if (bytes > maxBytes) trim();  // the limit may have been lowered
+    }
+
+    // key of `source` for the output kind named by `variant`
+    static uint64_t key(sv source, sv variant) noexcept {
+        return hashBytes(source, hashBytes(variant, kOutputVersion));
+    }
+
+    // The output stored under `key`; false (a miss) if there is none or it
+    // is damaged, in which case it is removed.
+    bool get(uint64_t key, string& out) {
+        filesystem::path path = entryPath(key);
+        error_code ec;
+        uint64_t size = filesystem::file_size(path, ec);
+        CacheEntryHeader h{};
+        ifstream in(path, ios::binary);
+        bool ok = !ec &&
+                  in.read(reinterpret_cast<char*>(&h), sizeof(h)) &&
+                  memcmp(h.magic, kCacheMagic, sizeof(h.magic)) == 0 &&
+                  h.key == key && h.bytes == size - sizeof(h);
+        if (ok) {
+            out.resize(size_t(h.bytes));
+            ok = in.read(&out[0], streamsize(out.size())) &&
+                 hashBytes(out, key) == h.check;
+        }
+        if (!ok) {
+            bool damaged = in.is_open();  // else it just isn't there
+            in.close();
+            if (damaged && filesystem::remove(path, ec) && !ec)
+                bytes -= min<uint64_t>(bytes, size);
+            ++misses;
+            return false;
+        }
+        filesystem::last_write_time(
+            path, filesystem::file_time_type::clock::now(), ec);
+        ++hits;
+        return true;
+    }
+
+    // Stores `output` under `key`; false if it could not be written.
+    bool put(uint64_t key, sv output) {
+        CacheEntryHeader h{};
+        memcpy(h.magic, kCacheMagic, sizeof(h.magic));
+        h.key = key;
+        h.bytes = output.size();
+        h.check = hashBytes(output, key);
+        filesystem::path path = entryPath(key);
+        filesystem::path tmp = path;
+        tmp += "." + to_string(serial++) + ".tmp";
+        {
+            ofstream out(tmp, ios::binary);
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(output.data(), streamsize(output.size()));
+            if (!out) {
+                error_code ec;
+                filesystem::remove(tmp, ec);
+                return false;
+            }
+        }
+        error_code ec;
+        filesystem::rename(tmp, path, ec);
+        if (ec) {
+            filesystem::remove(tmp, ec);
+            return false;
+        }
+        ++writes;
+        if ((bytes += sizeof(h) + output.size()) > maxBytes) trim();
+        return true;
+    }
+
+    Stats stats() const noexcept {
+        return {hits, misses, writes, evictions, bytes};
+    }
+
+   private:
+    filesystem::path entryPath(uint64_t key) const {
+        char name[21];
+        snprintf(name, sizeof(name), "%016llx.lpc", (unsigned long long)key);
+        return dir / name;
+    }
+
+    // Whether a file name is one of ours: "<16 hex digits>.lpc", or that
+    // plus ".<serial>.tmp" for a write in progress (or left by a crash).
+    // Nothing else in the directory is counted or removed.
+    static bool ownsName(sv name) noexcept {
+        if (name.size() < 20 || name.substr(16, 4) != ".lpc") return false;
+        for (char c : name.substr(0, 16))
+            if (!is_digit(c) && (c < 'a' || c > 'f')) return false;
+        sv rest = name.substr(20);
+        if (rest.empty()) return true;
+        if (rest.size() < 6 || rest[0] != '.' ||
+            rest.substr(rest.size() - 4) != ".tmp")
+            return false;
+        for (char c : rest.substr(1, rest.size() - 5))
+            if (!is_digit(c)) return false;
+        return true;
+    }
+
+    // Total size of the cache's files; with `entries`, also lists them.
+    struct Entry {
+        filesystem::file_time_type used;
+        uint64_t bytes;
+        filesystem::path path;
+    };
+    uint64_t scan(vector<Entry>* entries) const {
+        uint64_t total = 0;
+        error_code ec;
+        for (filesystem::directory_iterator it(dir, ec), end; it != end;
+             it.increment(ec)) {
+            if (ec) break;
+            if (!it->is_regular_file(ec) ||
+                !ownsName(it->path().filename().string()))
+                continue;
+            uint64_t size = it->file_size(ec);
+            total += size;
+            if (entries)
+                entries->push_back({it->last_write_time(ec), size, it->path()});
+        }
+        return total;
+    }
+
+    // Removes the least recently used entries until the cache is down to
+    // 90% of the limit, so a full cache doesn't rescan on every write. One
+    // thread trims at a time; the others carry on.
+    void trim() {
+        unique_lock<mutex> guard(trimLock, try_to_lock);
+        if (!guard) return;
+        vector<Entry> entries;
+        uint64_t total = scan(&entries);
+        sort(entries.begin(), entries.end(),
+             [](const Entry& a, const Entry& b) { return a.used < b.used; });
+        uint64_t target = maxBytes / 10 * 9;
+        error_code ec;
+        for (size_t i = 0; i < entries.size() && total > target; ++i) {
+            if (!filesystem::remove(entries[i].path, ec)) continue;
+            total -= entries[i].bytes;
+            ++evictions;
+        }
+        bytes = total;
+    }
+
+    filesystem::path dir;
+    uint64_t maxBytes;
+    atomic<uint64_t> serial;  // temporary names, unique per process
+    atomic<uint64_t> bytes{0};
+    atomic<size_t> hits{0}, misses{0}, writes{0}, evictions{0};
+    mutex trimLock;
+};
+
+// ---------------- Batch mode ----------------
+// Many files in one process: inputs are files, directories (searched
+// recursively for *.lua) and glob patterns, expanded with std::filesystem
+// so they also work where the shell doesn't glob. Files are parsed on a
+// thread pool, largest first, so the run doesn't end waiting on one big
+// file that started late.
+
+struct BatchOptions {
+    vector<string> inputs;
+    string outDir;  // one <name>.json per file here; empty: one stream
+    unsigned threads = 0;  // 0 = all cores
+    bool check = false;    // Validate() only: one "<path>: ok" line each
+    bool compact = false;  // JSON without whitespace
+    bool binary = false;   // <name>.ast binary ASTs under outDir instead
+    bool streaming = false;  // JSON written while each file is parsed
+    string cacheDir;       // ParseCache directory; empty: no cache
+    uint64_t cacheBytes = uint64_t(512) << 20;
+    bool uring = true;     // io_uring reads where the kernel has them
+};
+
+struct BatchFile {
+    filesystem::path path;
+    string name;  // relative to the directory or glob it came from
+    uintmax_t size = 0;
+};
+
+static bool hasGlob(sv s) { return s.find_first_of("*?[") != sv::npos; }
+
+// `*` and `?` stop at '/', `**` doesn't; `[...]` is a character set.
+static bool globMatch(sv pat, sv path) {
+    while (!pat.empty()) {
+        if (pat.substr(0, 2) == "**") {
+            pat.remove_prefix(pat.substr(0, 3) == "**/" ? 3 : 2);
+            if (pat.empty()) return true;
+            for (size_t i = 0; i <= path.size(); ++i)
+                if ((i == 0 || path[i - 1] == '/') &&
+                    globMatch(pat, path.substr(i)))
+                    return true;
+            return false;
+        }
+        if (pat[0] == '*') {
+            pat.remove_prefix(1);
+            for (size_t i = 0; i <= path.size(); ++i) {
+                if (globMatch(pat, path.substr(i))) return true;
+                if (i < path.size() && path[i] == '/') break;
+            }
+            return false;
+        }
+        if (path.empty() || (path[0] == '/' && pat[0] != '/')) return false;
+        if (pat[0] == '[') {
+            size_t close = pat.find(']', 2);
+            if (close == sv::npos) return false;
+            bool negate = pat[1] == '!' || pat[1] == '^', found = false;
+            for (size_t i = 1 + negate; i < close; ++i) {
+                if (i + 2 < close && pat[i + 1] == '-') {
+                    found |= path[0] >= pat[i] && path[0] <= pat[i + 2];
+                    i += 2;
+                } else {
+                    found |= path[0] == pat[i];
+                }
+            }
+            if (found == negate) return false;
+            pat.remove_prefix(close + 1);
+        } else {
+            if (pat[0] != '?' && pat[0] != path[0]) return false;
+            pat.remove_prefix(1);
+        }
+        path.remove_prefix(1);
+    }
+    return path.empty();
+}
+
+// Every file the inputs name, largest first; false if one matched nothing.
+static bool expandInputs(const vector<string>& inputs,
+                         vector<BatchFile>& files) {
+    namespace fs = filesystem;
+    bool ok = true;
+    auto walk = [&](const fs::path& root, auto&& keep) {
+        error_code ec;
+        for (fs::recursive_directory_iterator
+                 it(root, fs::directory_options::skip_permission_denied, ec),
+             end;
+             it != end; it.increment(ec)) {
+            if (ec) break;
+            if (!it->is_regular_file(ec)) continue;
+            string rel = it->path().lexically_relative(root).generic_string();
+            if (keep(rel))
+                files.push_back({it->path(), rel, it->file_size(ec)});
+        }
+    };
+    for (const string& in : inputs) {
+        size_t before = files.size();
+        if (hasGlob(in)) {
+            // walk from the last directory before the first wildcard
+            string pat = fs::path(in).generic_string();
+            size_t slash = pat.find_last_of('/', pat.find_first_of("*?["));
+            bool bare = slash == string::npos;
+            fs::path root = bare ? "." : pat.substr(0, slash + 1);
+            string rest = bare ? pat : pat.substr(slash + 1);
+            walk(root, [&](const string& rel) { return globMatch(rest, rel); });
+        } else if (fs::is_directory(in)) {
+            walk(in, [](const string& rel) {
+                return fs::path(rel).extension() == ".lua";
+            });
+        } else if (fs::is_regular_file(in)) {
+            // named as given, unless that leads out of the current directory
+            error_code ec;
+            fs::path rel = fs::absolute(in, ec).lexically_normal();
+            rel = rel.lexically_proximate(fs::current_path(ec));
+            if (rel.empty() || *rel.begin() == "..") rel = rel.filename();
+            files.push_back({in, rel.generic_string(), fs::file_size(in)});
+        }
+        if (files.size() == before) {
+            cerr << "Error: nothing found for -> " << in << "\n";
+            ok = false;
+        }
+    }
+    // a name is an output path and a combined entry's "file", so two files
+    // can't share one; the same file named twice is parsed once
+    stable_sort(files.begin(), files.end(),
+                [](const BatchFile& a, const BatchFile& b) {
+                    return a.name < b.name;
+                });
+    size_t kept = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (kept && files[kept - 1].name == files[i].name) {
+            error_code ec;
+            if (fs::equivalent(files[kept - 1].path, files[i].path, ec))
+                continue;
+            cerr << "Error: " << files[kept - 1].path.string() << " and "
+                 << files[i].path.string() << " would both be written as "
+                 << files[i].name << "\n";
+            ok = false;
+            continue;
+        }
+        if (kept != i) files[kept] = move(files[i]);
+        ++kept;
+    }
+    files.resize(kept);
+    stable_sort(files.begin(), files.end(),
+                [](const BatchFile& a, const BatchFile& b) {
+                    return a.size > b.size;
+                });
+    return ok;
+}
+
+static bool readFile(const filesystem::path& path, string& out) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    in.seekg(0, ios::end);
+    out.resize(size_t(in.tellg()));
+    in.seekg(0, ios::beg);
+    return bool(in.read(&out[0], streamsize(out.size())));
+}
+
+// Runs are a three-stage pipeline, so the disk and the cores work at once:
+// one thread reads files largest first, a pool lexes, parses and
+// serializes them, and the calling thread finishes each file in that order
+// (combined output, check lines, statistics). The stages are joined by
+// bounded buffers, so a stage that runs ahead waits instead of piling up
+// sources or outputs: throughput is that of the slowest stage and memory
+// stays bounded however many files there are.
+
+// A FIFO between two stages. push() waits while `maxItems` items are
+// queued or the item's cost (bytes, say) would take the total past
+// `maxCost`; an empty queue takes any item, however large. pop() waits for
+// an item and fails once the queue is closed and empty.
+template <class T>
+class BoundedQueue {
+   public:
+    BoundedQueue(size_t maxItems, size_t maxCost)
+        : maxItems(max<size_t>(1, maxItems)), maxCost(maxCost) {}
+
+    void push(T item, size_t cost = 0) {
+        unique_lock<mutex> lock(m);
+        auto fits = [&] {
+            return items.empty() || (items.size() < maxItems &&
+                                     cost <= maxCost - min(maxCost, queued));
+        };
+        if (!fits()) {
+            auto s0 = chrono::steady_clock::now();
+            room.wait(lock, fits);
+            stalledMs += chrono::duration<double, milli>(
+                             chrono::steady_clock::now() - s0)
+                             .count();
+        }
+        items.emplace_back(move(item), cost);
+        queued += cost;
+        peakItems = max(peakItems, items.size());
+        peakCost = max(peakCost, queued);
+        lock.unlock();
+        ready.notify_one();
+    }
+    bool pop(T& item) {
+        unique_lock<mutex> lock(m);
+        ready.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = move(items.front().first);
+        queued -= items.front().second;
+        items.pop_front();
+        lock.unlock();
+        room.notify_one();
+        return true;
+    }
+    void close() {
+        {
+            lock_guard<mutex> lock(m);
+            closed = true;
+        }
+        ready.notify_all();
+    }
+
+    // most items and cost queued at once, and push()'s total wait
+    struct Stats {
+        size_t peakItems, peakCost;
+        double stalledMs;
+    };
+    Stats stats() {
+        lock_guard<mutex> lock(m);
+        return Stats{peakItems, peakCost, stalledMs};
+    }
+
+   private:
+    mutex m;
+    condition_variable ready, room;
+    deque<pair<T, size_t>> items;
+    size_t maxItems, maxCost, queued = 0;
+    size_t peakItems = 0, peakCost = 0;
+    double stalledMs = 0;
+    bool closed = false;
+};
+
+// Results handed to one consumer in index order, whatever order they are
+// produced in. put(i) waits while i is `window` or more past the next
+// index to take, so finished results can't pile up behind a slow one (the
+// next index always fits). The consumer calls take() and, once done with
+// the result, finish(); waitTurn(i) waits until that happened to every
+// result before i.
+template <class T>
+class OrderedSlots {
+   public:
+    explicit OrderedSlots(size_t window)
+        : slots(max<size_t>(1, window)), filled(slots.size(), 0) {}
+
+    void put(size_t i, T value) {
+        unique_lock<mutex> lock(m);
+        moved.wait(lock, [&] { return i < next + slots.size(); });
+        slots[i % slots.size()] = move(value);
+        filled[i % slots.size()] = 1;
+        lock.unlock();
+        moved.notify_all();
+    }
+    T take() {
+        unique_lock<mutex> lock(m);
+        size_t at = next % slots.size();
+        moved.wait(lock, [&] { return filled[at] != 0; });
+        T value = move(slots[at]);
+        filled[at] = 0;
+        ++next;
+        lock.unlock();
+        moved.notify_all();
+        return value;
+    }
+    void finish() {
+        {
+            lock_guard<mutex> lock(m);
+            ++done;
+        }
+        moved.notify_all();
+    }
+    void waitTurn(size_t i) {
+        unique_lock<mutex> lock(m);
+        moved.wait(lock, [&] { return done == i; });
+    }
+
+   private:
+    mutex m;
+    condition_variable moved;
+    vector<T> slots;
+    vector<char> filled;
+    size_t next = 0;  // index take() returns next
+    size_t done = 0;  // results taken and finished
+};
+
+#ifdef LUAP_URING
+// Just enough io_uring, on the raw system calls, to keep several file
+// reads in flight from one thread. open() fails where the kernel lacks it
+// or forbids it; once a submission fails, ok() is false and the ring takes
+// no more reads.
+class IoRing {
+   public:
+    IoRing() = default;
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+    ~IoRing() { close(); }
+
+    bool open(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = int(syscall(__NR_io_uring_setup, entries, &p));
+        if (ringFd < 0) return false;
+        sqBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqBytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqeBytes = p.sq_entries * sizeof(io_uring_sqe);
+        shared = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (shared) sqBytes = cqBytes = max(sqBytes, cqBytes);
+        auto map = [&](size_t bytes, off_t at) -> void* {
+            void* q = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ringFd, at);
+            return q == MAP_FAILED ? nullptr : q;
+        };
+        sqMap = map(sqBytes, IORING_OFF_SQ_RING);
+        cqMap = shared ? sqMap : map(cqBytes, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe*>(map(sqeBytes, IORING_OFF_SQES));
+        if (!sqMap || !cqMap || !sqes) {
+            close();
+            return false;
+        }
+        char* sq = static_cast<char*>(sqMap);
+        char* cq = static_cast<char*>(cqMap);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        broken = false;
+        return true;
+    }
+    void close() noexcept {
+        if (sqes) munmap(sqes, sqeBytes);
+        if (cqMap && cqMap != sqMap) munmap(cqMap, cqBytes);
+        if (sqMap) munmap(sqMap, sqBytes);
+        if (ringFd >= 0) ::close(ringFd);
+        sqes = nullptr;
+        sqMap = cqMap = nullptr;
+        ringFd = -1;
+    }
+    bool ok() const noexcept { return ringFd >= 0 && !broken; }
+
+    // Submits a read of `len` bytes at `offset` of `fd` into `into`; its
+    // completion carries `tag`. At most `entries` reads may be in flight.
+    bool read(int fd, char* into, unsigned len, uint64_t offset,
+              uint64_t tag) {
+        if (!ok()) return false;
+        unsigned tail = *sqTail;  // only this thread moves it
+        unsigned at = tail & sqMask;
+        io_uring_sqe& e = sqes[at];
+        memset(&e, 0, sizeof(e));
+        e.opcode = IORING_OP_READ;
+        e.fd = fd;
+        e.addr = uint64_t(uintptr_t(into));
+        e.len = len;
+        e.off = offset;
+        e.user_data = tag;
+        sqArray[at] = at;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        for (;;) {
+            long n = syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, nullptr, 0);
+            if (n == 1) return true;
+            if (n == 0 || errno != EINTR) break;
+        }
+        broken = true;  // the entry stays unsubmitted: nothing submits again
+        return false;
+    }
+    // Waits for a completion: the read's tag and its byte count or -errno.
+    bool wait(uint64_t& tag, int& result) {
+        for (;;) {
+            unsigned head = *cqHead;
+            if (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe& c = cqes[head & cqMask];
+                tag = c.user_data;
+                result = c.res;
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR)
+                return false;
+        }
+    }
+
+   private:
+    int ringFd = -1;
+    bool broken = true, shared = false;
+    void *sqMap = nullptr, *cqMap = nullptr;
+    size_t sqBytes = 0, cqBytes = 0, sqeBytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned *sqTail = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr;
+    unsigned sqMask = 0, cqMask = 0;
+};
+#endif
+
+struct BatchSource {
+    size_t index = 0;
+    shared_ptr<string> code;
+    bool read = false;
+};
+
+// Read stage: every file, in order, into `out`, each costing its size.
+// With io_uring, up to `depth` reads are in flight at once (fewer while
+// they hold `budget` bytes) and finished files are passed on in order;
+// otherwise, and for anything the ring can't read, files are read one
+// after another. Returns whether io_uring was used.
+static bool readSources(const vector<BatchFile>& files,
+                        BoundedQueue<BatchSource>& out, bool uring,
+                        size_t budget) {
+    size_t n = files.size(), next = 0;
+    auto readNow = [&](BatchSource& src) {
+        src.code = make_shared<string>();
+        src.read = readFile(files[src.index].path, *src.code);
+    };
+#ifdef LUAP_URING
+    struct Pending {
+        BatchSource src;
+        int fd = -1;
+        size_t got = 0, charged = 0;  // bytes read; counted in flight
+        bool done = false;
+    };
+    deque<Pending> inflight;  // files [first, next), in order
+    vector<shared_ptr<string>> lost;  // buffers of reads never reaped
+    IoRing ring;  // closed first: no read outlives its buffer
+    const unsigned depth = 16;
+    if (uring && ring.open(depth)) {
+        size_t first = 0, bytes = 0;
+        auto readRest = [&](Pending& p) {
+            size_t left = p.src.code->size() - p.got;
+            return ring.read(p.fd, &(*p.src.code)[p.got],
+                             unsigned(min<size_t>(left, size_t(1) << 30)),
+                             p.got, p.src.index);
+        };
+        while (first < n) {
+            while (next < n && inflight.size() < depth &&
+                   (inflight.empty() || bytes < budget)) {
+                Pending& p = inflight.emplace_back();
+                p.src.index = next++;
+                p.src.code = make_shared<string>();
+                p.fd = ::open(files[p.src.index].path.c_str(),
+                              O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if (p.fd >= 0 && fstat(p.fd, &st) == 0 &&
+                    S_ISREG(st.st_mode) && st.st_size > 0) {
+                    p.src.code->resize(size_t(st.st_size));
+                    p.charged = p.src.code->size();
+                    bytes += p.charged;
+                    if (readRest(p)) continue;
+                }
+                readNow(p.src);  // empty, special or unreadable by the ring
+                p.done = true;
+            }
+            while (!inflight.empty() && inflight.front().done) {
+                Pending& p = inflight.front();
+                if (p.fd >= 0) ::close(p.fd);
+                bytes -= p.charged;
+                size_t size = p.src.code->size();
+                out.push(move(p.src), size);
+                inflight.pop_front();
+                ++first;
+            }
+            if (inflight.empty()) continue;
+            uint64_t tag;
+            int result;
+            if (!ring.wait(tag, result)) {  // the ring failed under us
+                for (Pending& p : inflight)
+                    if (!p.done) {
+                        lost.push_back(p.src.code);
+                        readNow(p.src);
+                        p.done = true;
+                    }
+                continue;
+            }
+            Pending& p = inflight[size_t(tag) - first];
+            if (result > 0) {
+                p.got += size_t(result);
+                if (p.got < p.src.code->size() && readRest(p)) continue;
+            }
+            if (result == 0) p.src.code->resize(p.got);  // it shrank
+            if (result >= 0 && p.got == p.src.code->size())
+                p.src.read = true;
+            else
+                readNow(p.src);
+            p.done = true;
+        }
+        return true;
+    }
+#else
+    (void)uring;
+    (void)budget;
+#endif
+    for (; next < n; ++next) {
+        BatchSource src;
+        src.index = next;
+        readNow(src);
+        size_t size = src.code->size();
+        out.push(move(src), size);
+    }
+    return false;
+}
 
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::ELSE) {
-                    int elseLine = Tokens[Index].line;
-                    ++Index;
-                    vector<AST> elseBlock;
-                    while (Index < (int)Tokens.size() &&
-                           Tokens[Index].type != TokenType::END) {
-                        AST node = parseExpressionForwardDecl(Tokens, Index);
-                        elseBlock.push_back(move(node));
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::SEMICOLON)
-                            ++Index;
-                        if (Index >= (int)Tokens.size()) break;
-                    }
-                    AST ech =
-                        makeLeaf(ASTType::ElseClause, sv("else"), elseLine);
-                    AST eb = makeLeaf(ASTType::Block, sv("else"), elseLine);
-                    if (!elseBlock.empty())
-                        eb.children["statements"] = move(elseBlock);
-                    ech.children["body"].push_back(move(eb));
-                    clauses.push_back(move(ech));
-                }
+// What the last stage needs of a finished file.
+struct BatchResult {
+    string error;
+    string entry;          // its entry of the combined array, if any
+    bool written = false;  // the entry already went out, streamed
+    double ms = 0;         // lex, parse and serialize
+    size_t bytes = 0;
+};
 
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::END)
-                    ++Index;
-                AST ifnode = makeLeaf(ASTType::IfStatement, sv("if"), line);
-                if (!clauses.empty())
-                    ifnode.children["clauses"] = move(clauses);
-                Chunk.push_back(move(ifnode));
-                break;
+// Parses every input file and writes its JSON, either to its own file
+// under outDir or as one entry of a combined array on stdout, in the order
+// files are scheduled: largest first, ties in the order found. With
+// `check`, files are only validated and stdout gets one line per file
+// instead. With `streaming`, statements are written as they are
+// parsed; a combined entry then goes out once the ones before it have.
+// Per-file and stage statistics go to stderr. Returns the exit status: 1
+// if any file could not be found, read, parsed or written, or failed the
+// check.
+static int runBatch(const BatchOptions& opts) {
+    vector<BatchFile> files;
+    bool ok = expandInputs(opts.inputs, files);
+    unsigned threads = opts.threads ? opts.threads
+                                    : max(1u, thread::hardware_concurrency());
+
+    bool firstEntry = true;
+    bool stream = !opts.check && opts.outDir.empty();  // combined JSON
+    size_t failed = 0, bytes = 0;
+    bool compact = opts.compact;
+    unique_ptr<ParseCache> cache;
+    if (!opts.cacheDir.empty())
+        cache = make_unique<ParseCache>(opts.cacheDir, opts.cacheBytes);
+    // names what a cached output is: stream entries are indented, no name
+    sv variant = opts.check    ? "check"
+                 : stream      ? (compact ? "entry-compact" : "entry")
+                 : opts.binary ? "ast"
+                               : (compact ? "json-compact" : "json");
+
+    // two files a worker read ahead, within 64 MiB unless one is larger
+    BoundedQueue<BatchSource> sources(size_t(threads) * 2, size_t(64) << 20);
+    OrderedSlots<BatchResult> results(size_t(threads) * 2);
+    auto process = [&](const BatchSource& src, BatchResult& r) {
+        const BatchFile& f = files[src.index];
+        const shared_ptr<string>& code = src.code;
+        string& error = r.error;
+        JsonWriter json;  // this file's entry of the combined array
+        auto entry = [&](sv key) {  // starts it, up to the value of `key`
+            json.raw(compact ? "{\"file\":" : "  {\n    \"file\": ");
+            json.quoted(f.name);
+            json.raw(compact ? ",\"" : ",\n    \"");
+            json.raw(key);
+            json.raw(compact ? "\":" : "\": ");
+        };
+        filesystem::path out =
+            filesystem::path(opts.outDir) /
+            filesystem::path(f.name + (opts.binary ? ".ast" : ".json"));
+        auto save = [&](sv output) {  // the whole output file at once
+            error_code ec;
+            filesystem::create_directories(out.parent_path(), ec);
+            ofstream file(out, ios::binary);
+            if (!file.write(output.data(), streamsize(output.size())))
+                error = "cannot write " + out.string();
+        };
+        bool read = src.read, hit = false;
+        uint64_t key = 0;
+        string cached;
+        if (read && cache) {
+            key = ParseCache::key(*code, variant);
+            hit = cache->get(key, cached);
+        }
+        if (!read) {
+            error = "cannot read file";
+        } else if (hit) {  // checks only store passes, so there is no error
+            if (stream) {
+                entry("ast");
+                json.raw(cached);
+                json.raw(compact ? "}" : "\n  }");
+            } else if (!opts.check) {
+                save(cached);
             }
-            case TokenType::WHILE: {
-                int line = t.line;
-                ++Index;
-                AST cond = parseExpressionForwardDecl(Tokens, Index);
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::DO)
-                    ++Index;
-                vector<AST> body;
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type != TokenType::END) {
-                    AST node = parseExpressionForwardDecl(Tokens, Index);
-                    body.push_back(move(node));
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::SEMICOLON)
-                        ++Index;
+        } else if (opts.streaming && !opts.check) {
+            SymbolTable symbols;
+            LineIndex lines(*code);
+            ParseError e;
+            if (stream) {
+                results.waitTurn(src.index);  // stdout is ours until put()
+                cout << (firstEntry ? "" : compact ? "," : ",\n");
+                firstEntry = false;
+                r.written = true;
+                entry("ast");
+                cout.write(json.data().data(), streamsize(json.data().size()));
+                JsonWriter live(cout);
+                e = StreamChunkJson(*code, lines, live, 4, compact, symbols);
+                if (e) {
+                    error = "line " + to_string(lines.line(e.offset)) + ": " +
+                            describe(e);
+                    live.raw(compact ? ",\"error\":" : ",\n    \"error\": ");
+                    live.quoted(error);
                 }
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::END)
-                    ++Index;
-                AST w = makeLeaf(ASTType::WhileStatement, sv("while"), line);
-                AST wb = makeLeaf(ASTType::Block, sv("while_body"), line);
-                if (!body.empty()) wb.children["statements"] = move(body);
-                w.children["condition"].push_back(move(cond));
-                w.children["body"].push_back(move(wb));
-                Chunk.push_back(move(w));
-                break;
-            }
-            case TokenType::FUNCTION: {
-                int line = t.line;
-                ++Index;
-                string funcName;
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::IDENTIFIER) {
-                    funcName.assign(Tokens[Index].text.begin(),
-                                    Tokens[Index].text.end());
-                    ++Index;
-                } else
-                    funcName = "<anon>";
-                vector<AST> params;
-                params.reserve(6);
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::LEFT_PAREN) {
-                    ++Index;
-                    while (Index < (int)Tokens.size() &&
-                           Tokens[Index].type != TokenType::RIGHT_PAREN) {
-                        if (Tokens[Index].type == TokenType::IDENTIFIER) {
-                            params.push_back(makeLeaf(ASTType::Identifier,
-                                                      Tokens[Index].text,
-                                                      Tokens[Index].line));
-                            ++Index;
-                            if (Index < (int)Tokens.size() &&
-                                Tokens[Index].type == TokenType::COMMA)
-                                ++Index;
-                        } else
-                            ++Index;
-                    }
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::RIGHT_PAREN)
-                        ++Index;
+                live.raw(compact ? "}" : "\n  }");
+            } else {
+                error_code ec;
+                filesystem::create_directories(out.parent_path(), ec);
+                ofstream file(out, ios::binary);
+                {
+                    JsonWriter w(file);
+                    e = StreamChunkJson(*code, lines, w, 0, compact, symbols);
+                    w.raw('\n');
                 }
-                vector<AST> body;
-                body.reserve(8);
-                while (Index < (int)Tokens.size() &&
-                       Tokens[Index].type != TokenType::END) {
-                    if (Tokens[Index].type == TokenType::RETURN) {
-                        int rline = Tokens[Index].line;
-                        ++Index;
-                        vector<AST> retvals;
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type != TokenType::SEMICOLON)
-                            retvals = parseExpressionList(Tokens, Index);
-                        AST rt = makeLeaf(ASTType::ReturnStatement,
-                                          sv("return"), rline);
-                        if (!retvals.empty())
-                            rt.children["values"] = move(retvals);
-                        body.push_back(move(rt));
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::SEMICOLON)
-                            ++Index;
-                        continue;
-                    }
-                    AST node = parseExpressionForwardDecl(Tokens, Index);
-                    body.push_back(move(node));
-                    if (Index < (int)Tokens.size() &&
-                        Tokens[Index].type == TokenType::SEMICOLON)
-                        ++Index;
+                if (e) {
+                    error = "line " + to_string(lines.line(e.offset)) + ": " +
+                            describe(e);
+                    file.close();
+                    filesystem::remove(out, ec);
+                } else if (!file) {
+                    error = "cannot write " + out.string();
                 }
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::END)
-                    ++Index;
-                AST fd = makeLeaf(ASTType::FunctionDeclaration, sv("function"),
-                                  line);
-                AST id = makeLeaf(ASTType::Identifier, sv(funcName), line);
-                AST blk = makeLeaf(ASTType::Block, sv("body"), line);
-                if (!body.empty()) blk.children["statements"] = move(body);
-                fd.children["name"].push_back(move(id));
-                fd.children["body"].push_back(move(blk));
-                if (!params.empty()) fd.children["params"] = move(params);
-                Chunk.push_back(move(fd));
-                break;
             }
-            default: {
-                if (t.type == TokenType::IDENTIFIER) {
-                    if (Index + 1 < (int)Tokens.size() &&
-                        (Tokens[Index + 1].type == TokenType::EQUAL ||
-                         Tokens[Index + 1].type == TokenType::COMMA)) {
-                        vector<AST> vars;
-                        vars.reserve(4);
-                        while (Index < (int)Tokens.size() &&
-                               Tokens[Index].type == TokenType::IDENTIFIER) {
-                            vars.push_back(makeLeaf(ASTType::Identifier,
-                                                    Tokens[Index].text,
-                                                    Tokens[Index].line));
-                            ++Index;
-                            if (Index < (int)Tokens.size() &&
-                                Tokens[Index].type == TokenType::COMMA)
-                                ++Index;
-                            else
-                                break;
-                        }
-                        if (Index < (int)Tokens.size() &&
-                            Tokens[Index].type == TokenType::EQUAL) {
-                            ++Index;
-                            vector<AST> vals =
-                                parseExpressionList(Tokens, Index);
-                            AST asn = makeLeaf(ASTType::AssignmentStatement,
-                                               sv("assign"), t.line);
-                            if (!vars.empty())
-                                asn.children["variables"] = move(vars);
-                            if (!vals.empty())
-                                asn.children["values"] = move(vals);
-                            Chunk.push_back(move(asn));
-                        } else {
-                            AST expr =
-                                parseExpressionForwardDecl(Tokens, Index);
-                            AST ch =
-                                makeLeaf(ASTType::Chunk, sv("expr"), expr.line);
-                            ch.children["statements"].push_back(move(expr));
-                            Chunk.push_back(move(ch));
-                        }
-                    } else if (Index + 1 < (int)Tokens.size() &&
-                               Tokens[Index + 1].type ==
-                                   TokenType::LEFT_PAREN) {
-                        AST call = parseSuffixed(Tokens, Index);
-                        AST cs = makeLeaf(ASTType::CallStatement,
-                                          sv("call_stmt"), t.line);
-                        cs.children["expression"].push_back(move(call));
-                        Chunk.push_back(move(cs));
-                    } else {
-                        AST expr = parseExpressionForwardDecl(Tokens, Index);
-                        AST ch =
-                            makeLeaf(ASTType::Chunk, sv("expr"), expr.line);
-                        ch.children["statements"].push_back(move(expr));
-                        Chunk.push_back(move(ch));
-                    }
+        } else if (opts.check) {
+            StreamingLexer tokens(*code, bestScanLevel(), nullptr);
+            ParseError e = Validate(tokens);
+            if (e) {
+                LineIndex lines(*code);  // only needed to report it
+                error = "line " + to_string(lines.line(e.offset)) +
+                        ", column " + to_string(lines.column(e.offset)) +
+                        ": " + describe(e);
+            } else if (cache) {
+                cache->put(key, "");
+            }
+        } else {
+            SymbolTable symbols;  // the global table isn't thread-safe
+            auto tokens = LexStream(*code, bestScanLevel(), symbols);
+            ParseTree chunk = Parse(tokens, code);
+            if (chunk.error) {
+                error = "line " +
+                        to_string(tokens.lines.line(chunk.error.offset)) +
+                        ": " + describe(chunk.error);
+            } else if (stream) {
+                entry("ast");
+                size_t from = json.data().size();
+                writeChunkJson(chunk, tokens.lines, json, 4, compact);
+                if (cache) cache->put(key, sv(json.data()).substr(from));
+                json.raw(compact ? "}" : "\n  }");
+            } else if (cache) {  // kept whole in memory to store it
+                string output;
+                if (opts.binary) {
+                    ostringstream binary;
+                    WriteBinaryAst(chunk, tokens.lines, binary);
+                    output = binary.str();
                 } else {
-                    AST expr = parseExpressionForwardDecl(Tokens, Index);
-                    AST ch = makeLeaf(ASTType::Chunk, sv("expr"), expr.line);
-                    ch.children["statements"].push_back(move(expr));
-                    Chunk.push_back(move(ch));
+                    JsonWriter w;
+                    writeChunkJson(chunk, tokens.lines, w, 0, compact);
+                    w.raw('\n');
+                    output = w.data();
                 }
-                if (Index < (int)Tokens.size() &&
-                    Tokens[Index].type == TokenType::SEMICOLON)
-                    ++Index;
-                break;
-            }
-        }  // end switch
-    }  // end while
-    return Chunk;
-}
-
-// ---------- Test helpers / main ----------
-
-static inline string jsonEscape(const string& s) {
-    string out;
-    out.reserve(s.size() + 8);
-    for (unsigned char uc : s) {
-        switch (uc) {
-            case '\"':
-                out += "\\\"";
-                break;
-            case '\\':
-                out += "\\\\";
-                break;
-            case '\b':
-                out += "\\b";
-                break;
-            case '\f':
-                out += "\\f";
-                break;
-            case '\n':
-                out += "\\n";
-                break;
-            case '\r':
-                out += "\\r";
-                break;
-            case '\t':
-                out += "\\t";
-                break;
-            default:
-                if (uc < 0x20) {
-                    out += "\\u00";
-                    out += hexDigit(uc >> 4);
-                    out += hexDigit(uc & 0xF);
+                cache->put(key, output);
+                save(output);
+            } else {
+                error_code ec;
+                filesystem::create_directories(out.parent_path(), ec);
+                ofstream file(out, ios::binary);
+                if (opts.binary) {
+                    WriteBinaryAst(chunk, tokens.lines, file);
                 } else {
-                    out.push_back(static_cast<char>(uc));
+                    JsonWriter w(file);
+                    writeChunkJson(chunk, tokens.lines, w, 0, compact);
+                    w.raw('\n');
                 }
+                if (!file) error = "cannot write " + out.string();
+            }
         }
-    }
-    return out;
-}
+        r.bytes = code->size();
+        if (!stream || r.written) return;
+        if (!error.empty()) {
+            json.clear();
+            entry("error");
+            json.quoted(error);
+            json.raw(compact ? "}" : "\n  }");
+        }
+        r.entry = json.take();
+    };
 
-string astTypeToString(ASTType type) {
-    switch (type) {
-        case ASTType::AssignmentStatement:
-            return "AssignmentStatement";
-        case ASTType::LocalStatement:
-            return "LocalStatement";
-        case ASTType::Identifier:
-            return "Identifier";
-        case ASTType::BooleanLiteral:
-            return "BooleanLiteral";
-        case ASTType::StringLiteral:
-            return "StringLiteral";
-        case ASTType::NumericLiteral:
-            return "NumericLiteral";
-        case ASTType::FunctionDeclaration:
-            return "FunctionDeclaration";
-        case ASTType::FunctionExpression:
-            return "FunctionExpression";
-        case ASTType::CallStatement:
-            return "CallStatement";
-        case ASTType::CallExpression:
-            return "CallExpression";
-        case ASTType::BinaryExpression:
-            return "BinaryExpression";
-        case ASTType::ReturnStatement:
-            return "ReturnStatement";
-        case ASTType::DoStatement:
-            return "DoStatement";
-        case ASTType::WhileStatement:
-            return "WhileStatement";
-        case ASTType::TableConstructorExpression:
-            return "TableConstructorExpression";
-        case ASTType::TableValue:
-            return "TableValue";
-        case ASTType::TableKey:
-            return "TableKey";
-        case ASTType::MemberExpression:
-            return "MemberExpression";
-        case ASTType::UnaryExpression:
-            return "UnaryExpression";
-        case ASTType::IndexExpression:
-            return "IndexExpression";
-        case ASTType::ForGenericStatement:
-            return "ForGenericStatement";
-        case ASTType::ForNumericStatement:
-            return "ForNumericStatement";
-        case ASTType::IfStatement:
-            return "IfStatement";
-        case ASTType::IfClause:
-            return "IfClause";
-        case ASTType::ElseifClause:
-            return "ElseifClause";
-        case ASTType::ElseClause:
-            return "ElseClause";
-        case ASTType::BreakStatement:
-            return "BreakStatement";
-        case ASTType::GotoStatement:
-            return "GotoStatement";
-        case ASTType::LabelStatement:
-            return "LabelStatement";
-        case ASTType::RepeatStatement:
-            return "RepeatStatement";
-        case ASTType::VarargLiteral:
-            return "VarargLiteral";
-        case ASTType::NilLiteral:
-            return "NilLiteral";
-        case ASTType::Chunk:
-            return "Chunk";
-        case ASTType::Block:
-            return "Block";
-        case ASTType::VariableAttribute:
-            return "VariableAttribute";
-        case ASTType::LogicalExpression:
-            return "LogicalExpression";
-        case ASTType::TableKeyString:
-            return "TableKeyString";
-        default:
-            return "Unknown";
+    if (stream) cout << (compact ? "[" : "[\n");
+    auto t0 = chrono::high_resolution_clock::now();
+    double readMs = 0, writeMs = 0;
+    atomic<uint64_t> workUs{0};
+    bool uring = false;
+    thread reader([&] {
+        auto r0 = chrono::high_resolution_clock::now();
+        uring = readSources(files, sources, opts.uring, size_t(16) << 20);
+        readMs = chrono::duration<double, milli>(
+                     chrono::high_resolution_clock::now() - r0)
+                     .count();
+        sources.close();
+    });
+    thread pool([&] {
+        parallelFor(threads, [&](size_t) {
+            BatchSource src;
+            while (sources.pop(src)) {
+                auto w0 = chrono::high_resolution_clock::now();
+                BatchResult r;
+                process(src, r);
+                src.code.reset();  // the tree is gone; so can the source
+                auto w1 = chrono::high_resolution_clock::now();
+                r.ms = chrono::duration<double, milli>(w1 - w0).count();
+                workUs += uint64_t(r.ms * 1000.0);
+                results.put(src.index, move(r));
+            }
+        });
+    });
+    for (size_t i = 0; i < files.size(); ++i) {  // write stage
+        BatchResult r = results.take();
+        auto w0 = chrono::high_resolution_clock::now();
+        const BatchFile& f = files[i];
+        bytes += r.bytes;
+        if (opts.check)
+            cout << f.path.string() << ": "
+                 << (r.error.empty() ? "ok" : r.error) << "\n";
+        if (!r.error.empty()) {
+            ++failed;
+            cerr << "[Batch] " << f.path.string() << ": error: " << r.error
+                 << "\n";
+        } else {
+            cerr << "[Batch] " << f.path.string() << ": " << r.bytes
+                 << " bytes, " << r.ms << " ms, "
+                 << double(r.bytes) / (1024.0 * 1024.0) /
+                        (r.ms > 0 ? r.ms / 1000.0 : 1e-9)
+                 << " MB/s\n";
+        }
+        if (!r.entry.empty()) {
+            cout << (firstEntry ? "" : compact ? "," : ",\n");
+            cout.write(r.entry.data(), streamsize(r.entry.size()));
+            firstEntry = false;
+        }
+        writeMs += chrono::duration<double, milli>(
+                       chrono::high_resolution_clock::now() - w0)
+                       .count();
+        results.finish();
+    }
+    reader.join();
+    pool.join();
+    double secs = chrono::duration<double>(
+                      chrono::high_resolution_clock::now() - t0)
+                      .count();
+    if (stream) cout << (firstEntry || compact ? "]\n" : "\n]\n");
+    cout.flush();
+    cerr << "[Batch] " << files.size() << " files (" << failed
+         << " failed), " << bytes << " bytes on " << threads
+         << " threads in " << secs * 1000.0 << " ms: "
+         << double(bytes) / (1024.0 * 1024.0) / (secs > 0 ? secs : 1e-9)
+         << " MB/s, " << double(files.size()) / (secs > 0 ? secs : 1e-9)
+         << " files/s\n";
+    auto queued = sources.stats();
+    cerr << "[Batch] stages: read " << readMs - queued.stalledMs
+         << " ms with " << (uring ? "io_uring" : "read()") << " (then held "
+         << queued.stalledMs << " ms by full queue; at most "
+         << queued.peakItems << " files, " << queued.peakCost
+         << " bytes queued), parse " << double(workUs) / 1000.0 / threads
+         << " ms per worker, write " << writeMs << " ms\n";
+    if (cache) {
+        ParseCache::Stats st = cache->stats();
+        cerr << "[Cache] " << st.hits << " hits, " << st.misses
+             << " misses, " << st.writes << " writes, " << st.evictions
+             << " evicted; " << st.bytes << " bytes in " << opts.cacheDir
+             << "\n";
     }
+    return ok && failed == 0 ? 0 : 1;
 }
 
-// ---------------- JSON serializer ----------------
-void printASTJson(const AST& node, ostream& out, int indent = 0) {
-    string ind(indent, ' ');
-    out << ind << "{\n";
-
-    out << ind << "  \"nodeType\": \"" << astTypeToString(node.type) << "\",\n";
-    out << ind << "  \"text\": \"" << jsonEscape(node.text) << "\",\n";
-    out << ind << "  \"line\": " << node.line << ",\n";
-
-    out << ind << "  \"children\": {";
-    if (!node.children.empty()) out << "\n";
-
-    bool firstGroup = true;
-    for (auto it = node.children.begin(); it != node.children.end(); ++it) {
-        if (!firstGroup) out << ",\n";
-        firstGroup = false;
+int main(int argc, char* argv[]) {
+    string filePath;
 
-        out << ind << "    \"" << it->first << "\": [\n";
-        for (size_t i = 0; i < it->second.size(); i++) {
-            printASTJson(it->second[i], out, indent + 6);
-            if (i + 1 < it->second.size()) out << ",";
-            out << "\n";
+    // batch mode: several inputs, a directory, a glob or an option
+    BatchOptions batch;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--out" && i + 1 < argc)
+            batch.outDir = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            batch.threads = unsigned(atoi(argv[++i]));
+        else if (arg == "--check")
+            batch.check = true;
+        else if (arg == "--compact")
+            batch.compact = true;
+        else if (arg == "--binary")
+            batch.binary = true;
+        else if (arg == "--stream")
+            batch.streaming = true;
+        else if (arg == "--cache" && i + 1 < argc)
+            batch.cacheDir = argv[++i];
+        else if (arg == "--cache-size" && i + 1 < argc)
+            batch.cacheBytes = uint64_t(atoll(argv[++i])) << 20;
+        else if (arg == "--no-uring")
+            batch.uring = false;
+        else
+            batch.inputs.push_back(arg);
+    }
+    if (argc > 2 || (argc == 2 && (hasGlob(argv[1]) ||
+                                   filesystem::is_directory(argv[1])))) {
+        if (batch.inputs.empty()) {
+            cerr << "Error: no input files\n";
+            return 1;
+        }
+        if (batch.binary && batch.outDir.empty() && !batch.check) {
+            cerr << "Error: --binary needs --out\n";
+            return 1;
+        }
+        if (batch.streaming && (batch.binary || !batch.cacheDir.empty())) {
+            cerr << "Error: --stream writes JSON, without --binary or "
+                    "--cache\n";
+            return 1;
         }
-        out << ind << "    ]";
+        return runBatch(batch);
     }
 
-    if (!node.children.empty()) out << "\n" << ind << "  ";
-    out << "}\n" << ind << "}";
-}
-int main(int argc, char* argv[]) {
-    string filePath;
-
     if (argc >= 2) {
         filePath = argv[1];
     } else {
@@ -1255,6 +6229,9 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
+        static volatile size_t blackhole = 0;
+        static volatile size_t blackholeLoad = 0;
+
         // ask user for parameters (defaults 50, 20000)
         string input;
         int REPEAT = 50;
@@ -1279,10 +6256,41 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        // Read file contents
-        ifstream in(filePath);
-        string code((istreambuf_iterator<char>(in)),
-                    istreambuf_iterator<char>());
+        // Load time on its own: a mapping (with every page touched, as the
+        // lexer would), one bulk read, and the old istreambuf copy
+        MappedFile source;
+        double loadMs[3] = {0, 0, 0};
+        const int loads = 5;
+        for (int i = 0; i < loads; ++i) {
+            auto l0 = chrono::high_resolution_clock::now();
+            source.open(filePath, true);
+            for (size_t k = 0; k < source.size(); k += 4096)
+                blackholeLoad += source.data()[k];
+            auto l1 = chrono::high_resolution_clock::now();
+            {
+                ifstream in(filePath, ios::binary);
+                string bulk(filesystem::file_size(filePath), '\0');
+                in.read(bulk.data(), streamsize(bulk.size()));
+                blackholeLoad += bulk.size();
+            }
+            auto l2 = chrono::high_resolution_clock::now();
+            {
+                ifstream in(filePath);
+                string copied((istreambuf_iterator<char>(in)),
+                              istreambuf_iterator<char>());
+                blackholeLoad += copied.size();
+            }
+            auto l3 = chrono::high_resolution_clock::now();
+            loadMs[0] += chrono::duration<double, milli>(l1 - l0).count();
+            loadMs[1] += chrono::duration<double, milli>(l2 - l1).count();
+            loadMs[2] += chrono::duration<double, milli>(l3 - l2).count();
+        }
+        cout << fixed << setprecision(3) << "[Benchmark] Load: "
+             << (source.mapped() ? "mmap " : "bulk read ")
+             << loadMs[0] / loads << " ms vs read() " << loadMs[1] / loads
+             << " ms vs istreambuf " << loadMs[2] / loads << " ms ("
+             << source.size() << " bytes)\n";
+        string code(source.text());
 
         // Build code * REPEAT
         string testCode;
@@ -1294,10 +6302,8 @@ int main(int argc, char* argv[]) {
 
         auto t0 = chrono::high_resolution_clock::now();
 
-        static volatile size_t blackhole = 0;
-
         for (int i = 0; i < RUNS; ++i) {
-            auto tokens = Lexer(testCode);
+            auto tokens = LexStream(testCode);
             auto chunk = Parse(tokens);
             blackhole += chunk.size();
         }
@@ -1314,31 +6320,756 @@ int main(int argc, char* argv[]) {
              << " ms\n";
         cout << "[Benchmark] blackhole (sum of chunk sizes): " << blackhole
              << "\n";
+
+        // Arena footprint of one tree
+        {
+            auto tokens = LexStream(testCode);
+            ParseTree tree = Parse(tokens);
+            size_t nodes = 0;
+            for (size_t k = 0; k < tree.size(); ++k)
+                nodes += countNodes(tree[k]);
+            cout << "[Benchmark] AST: " << nodes << " nodes, "
+                 << tree.arena.bytesUsed() << " arena bytes in "
+                 << tree.arena.blockCount() << " blocks\n";
+        }
+
+        // Flat layout: conversion cost, size and a full traversal of each
+        {
+            auto source = make_shared<const string>(testCode);
+            auto tokens = LexStream(*source);
+            ParseTree tree = Parse(tokens, source);
+            auto f0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i) blackhole += Flatten(tree).size();
+            auto f1 = chrono::high_resolution_clock::now();
+            FlatTree flat = Flatten(tree);
+            auto walk = [&](const auto& t) {
+                auto w0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i)
+                    for (size_t k = 0; k < t.size(); ++k)
+                        blackhole += countNodes(t[k]);
+                auto w1 = chrono::high_resolution_clock::now();
+                return chrono::duration<double, milli>(w1 - w0).count() /
+                       double(RUNS);
+            };
+            double treeMs = walk(tree), flatMs = walk(flat);
+            ostringstream a, b;
+            for (size_t k = 0; k < tree.size(); ++k) {
+                printASTJson(tree[k], tokens.lines, a);
+                printASTJson(flat[k], tokens.lines, b);
+            }
+            cout << "[Benchmark] Flat AST: " << flat.nodes.size()
+                 << " nodes, " << flat.bytesUsed() << " bytes, flatten "
+                 << chrono::duration<double, milli>(f1 - f0).count() /
+                        double(RUNS)
+                 << " ms; traversal: arena " << treeMs << " ms, flat "
+                 << flatMs << " ms"
+                 << (a.str() == b.str() ? "" : "  [MISMATCH vs arena JSON]")
+                 << "\n";
+        }
+
+        // Binary AST: write, map and walk it; its JSON must match the
+        // tree's, both with text in the source and with text pooled
+        {
+            auto source = make_shared<const string>(testCode);
+            auto tokens = LexStream(*source);
+            ParseTree tree = Parse(tokens, source);
+            FlatTree flat = Flatten(tree);
+            filesystem::path path = filesystem::temp_directory_path() /
+                                    ("lua_parser_bench_" +
+                                     to_string(random_device{}()) + ".ast");
+            MappedAst saved;
+            auto save = [&](const string& bytes) {
+                saved.close();  // never rewrite a file that is mapped
+                ofstream out(path, ios::binary);
+                return bool(out.write(bytes.data(), streamsize(bytes.size())));
+            };
+            string bytes;
+            auto w0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i) {
+                ostringstream out;
+                WriteBinaryAst(flat, tokens.lines, out);
+                bytes = out.str();
+                blackhole += bytes.size();
+            }
+            auto w1 = chrono::high_resolution_clock::now();
+            bool same = save(bytes);
+            auto m0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i) {
+                same = saved.open(path) && same;
+                blackhole += saved.size();
+            }
+            auto m1 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i)
+                for (size_t k = 0; k < saved.size(); ++k)
+                    blackhole += countNodes(saved[k]);
+            auto m2 = chrono::high_resolution_clock::now();
+            ostringstream want, got, pooled, copy;
+            printChunkJson(tree, tokens.lines, want);
+            printChunkJson(saved, saved.lines(), got);
+            same = same && saved.verify() && want.str() == got.str();
+
+            ParseTree copied = Parse(tokens);  // no source: all text pooled
+            same = same && WriteBinaryAst(copied, tokens.lines, pooled) &&
+                   save(pooled.str()) && saved.open(path) &&
+                   saved.verify() && saved.source().empty();
+            printChunkJson(saved, saved.lines(), copy);
+            same = same && want.str() == copy.str();
+            saved.close();
+            error_code ec;
+            filesystem::remove(path, ec);
+
+            auto ms = [&](auto from, auto to) {
+                return chrono::duration<double, milli>(to - from).count() /
+                       double(RUNS);
+            };
+            cout << "[Benchmark] Binary AST: " << bytes.size()
+                 << " bytes, write " << ms(w0, w1) << " ms, open "
+                 << ms(m0, m1) << " ms, traversal " << ms(m1, m2) << " ms"
+                 << (same ? "" : "  [MISMATCH vs arena JSON]") << "\n";
+        }
+
+        // Parse only: node text copied into the arena vs viewing the source
+        {
+            auto source = make_shared<const string>(testCode);
+            auto tokens = LexStream(*source);
+            double ms[2];
+            for (int view = 0; view < 2; ++view) {
+                auto p0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i)
+                    blackhole += view ? Parse(tokens, source).size()
+                                      : Parse(tokens).size();
+                auto p1 = chrono::high_resolution_clock::now();
+                ms[view] = chrono::duration<double, milli>(p1 - p0).count() /
+                           double(RUNS);
+            }
+            cout << "[Benchmark] Average parse: copied text " << ms[0]
+                 << " ms, source views " << ms[1] << " ms\n";
+        }
+
+        // JSON serializer into one reused buffer (no I/O), pretty and
+        // compact; compact must be pretty without the whitespace
+        {
+            auto source = make_shared<const string>(testCode);
+            auto tokens = LexStream(*source);
+            ParseTree tree = Parse(tokens, source);
+            JsonWriter w;
+            double ms[2];
+            string text[2];
+            for (int compact = 0; compact < 2; ++compact) {
+                auto j0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i) {
+                    w.clear();
+                    writeChunkJson(tree, tokens.lines, w, 0, compact != 0);
+                    blackhole += w.data().size();
+                }
+                auto j1 = chrono::high_resolution_clock::now();
+                ms[compact] = chrono::duration<double, milli>(j1 - j0).count() /
+                              double(RUNS);
+                text[compact] = w.data();
+            }
+            string squeezed;
+            bool quoted = false;
+            for (size_t i = 0; i < text[0].size(); ++i) {
+                char c = text[0][i];
+                if (quoted && c == '\\')
+                    squeezed += text[0][i++];
+                else if (c == '"')
+                    quoted = !quoted;
+                else if (!quoted && (c == ' ' || c == '\n'))
+                    continue;
+                squeezed += text[0][i];
+            }
+            auto mbps = [&](int k) {
+                return double(text[k].size()) / (1024.0 * 1024.0) /
+                       (ms[k] > 0 ? ms[k] / 1000.0 : 1e-9);
+            };
+            cout << "[Benchmark] JSON writer: pretty " << text[0].size()
+                 << " bytes in " << ms[0] << " ms (" << mbps(0)
+                 << " MB/s), compact " << text[1].size() << " bytes in "
+                 << ms[1] << " ms (" << mbps(1) << " MB/s)"
+                 << (squeezed == text[1] ? "" : "  [MISMATCH vs pretty]")
+                 << "\n";
+        }
+
+        // Parse cache: hashing the source, then a hit (read and check the
+        // stored JSON) against producing it with lex+parse+serialize
+        {
+            filesystem::path dir = filesystem::temp_directory_path() /
+                                   ("lua_parser_cache_" +
+                                    to_string(random_device{}()));
+            double ms[3];
+            string made, stored;
+            bool same;
+            {
+                ParseCache cache(dir, uint64_t(1) << 30);
+                auto c0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i)
+                    blackhole += ParseCache::key(testCode, "json");
+                auto c1 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i) {
+                    auto tokens = LexStream(testCode);
+                    JsonWriter w;
+                    writeChunkJson(Parse(tokens), tokens.lines, w);
+                    made = w.data();
+                }
+                auto c2 = chrono::high_resolution_clock::now();
+                uint64_t key = ParseCache::key(testCode, "json");
+                same = cache.put(key, made);
+                for (int i = 0; i < RUNS; ++i)
+                    same = cache.get(ParseCache::key(testCode, "json"),
+                                     stored) && same;
+                auto c3 = chrono::high_resolution_clock::now();
+                same = same && stored == made;
+                ms[0] = chrono::duration<double, milli>(c1 - c0).count();
+                ms[1] = chrono::duration<double, milli>(c2 - c1).count();
+                ms[2] = chrono::duration<double, milli>(c3 - c2).count();
+                for (double& m : ms) m /= double(RUNS);
+            }
+            error_code ec;
+            filesystem::remove_all(dir, ec);
+            cout << "[Benchmark] Parse cache: hash "
+                 << double(testCode.size()) / (1024.0 * 1024.0) /
+                        (ms[0] > 0 ? ms[0] / 1000.0 : 1e-9)
+                 << " MB/s; hit " << ms[2] << " ms vs miss " << ms[1]
+                 << " ms" << (same ? "" : "  [MISMATCH vs fresh output]")
+                 << "\n";
+        }
+
+        // Streaming JSON: statements written as they are parsed vs a full
+        // tree first; both from the source, and the text must match
+        {
+            LineIndex lines(testCode);
+            JsonWriter w;
+            string text[2];
+            double ms[2];
+            for (int streamed = 0; streamed < 2; ++streamed) {
+                auto s0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i) {
+                    w.clear();
+                    if (streamed) {
+                        StreamChunkJson(testCode, lines, w);
+                    } else {
+                        auto tokens = LexStream(testCode);
+                        writeChunkJson(Parse(tokens), tokens.lines, w);
+                    }
+                    blackhole += w.data().size();
+                }
+                auto s1 = chrono::high_resolution_clock::now();
+                ms[streamed] =
+                    chrono::duration<double, milli>(s1 - s0).count() /
+                    double(RUNS);
+                text[streamed] = w.data();
+            }
+            cout << "[Benchmark] Streaming JSON: " << ms[1]
+                 << " ms vs lex+parse+write " << ms[0] << " ms"
+                 << (text[0] == text[1] ? "" : "  [MISMATCH vs tree JSON]")
+                 << "\n";
+        }
+
+        // Expression nesting far past the parser's native recursion, on
+        // generated 100k-deep expressions: parsed, then written as compact
+        // JSON and as a binary AST. Pretty JSON grows with the square of
+        // the depth (indentation), which is about a terabyte at 100k, so
+        // it is timed on 1k-deep copies.
+        {
+            const int kDeep = 100000, kPrettyDeep = 1000;
+            struct Shape {
+                const char* name;
+                const char* open;
+                const char* close;
+            };
+            const Shape shapes[] = {{"a .. a .. ...", "a .. ", "a"},
+                                    {"((((...))))", "(", ")"},
+                                    {"{{{{...}}}}", "{", "}"}};
+            auto ms = [](auto from, auto to) {
+                return chrono::duration<double, milli>(to - from).count();
+            };
+            for (const Shape& shape : shapes) {
+                auto nested = [&](int depth) {
+                    string deep = "x = ";
+                    for (int i = 0; i < depth; ++i) deep += shape.open;
+                    int closes = shape.open[0] == 'a' ? 1 : depth;
+                    for (int i = 0; i < closes; ++i) deep += shape.close;
+                    return deep;
+                };
+                string deep = nested(kDeep);
+                auto deepTokens = LexStream(deep);
+                ParseTree t = Parse(deepTokens);
+                auto e0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < 5; ++i)
+                    blackhole += Parse(deepTokens).size();
+                auto e1 = chrono::high_resolution_clock::now();
+                JsonWriter compact;
+                writeChunkJson(t, deepTokens.lines, compact, 0, true);
+                auto e2 = chrono::high_resolution_clock::now();
+                ostringstream binary;
+                bool same = WriteBinaryAst(t, deepTokens.lines, binary);
+                auto e3 = chrono::high_resolution_clock::now();
+                JsonWriter flat;
+                writeChunkJson(Flatten(t), deepTokens.lines, flat, 0, true);
+                same = same && flat.data() == compact.data();
+
+                string shallow = nested(kPrettyDeep);
+                auto shallowTokens = LexStream(shallow);
+                ParseTree shallowTree = Parse(shallowTokens);
+                JsonWriter pretty;
+                auto p0 = chrono::high_resolution_clock::now();
+                writeChunkJson(shallowTree, shallowTokens.lines, pretty);
+                auto p1 = chrono::high_resolution_clock::now();
+                cout << "[Benchmark] Depth " << kDeep << " " << shape.name
+                     << ": " << ms(e0, e1) / 5.0 << " ms ("
+                     << (t.error ? "TooDeep" : "ok") << ", "
+                     << countNodes(t[0]) << " nodes), compact JSON "
+                     << ms(e1, e2) << " ms (" << compact.data().size()
+                     << " bytes), binary " << ms(e2, e3) << " ms ("
+                     << binary.str().size() << " bytes), pretty JSON at "
+                     << kPrettyDeep << " levels " << ms(p0, p1) << " ms ("
+                     << pretty.data().size() << " bytes)"
+                     << (same ? "" : "  [MISMATCH vs flat JSON]") << "\n";
+            }
+        }
+
+        // Same work with the pull-based lexer feeding the parser directly
+        {
+            auto s0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i) {
+                StreamingLexer lx(testCode);
+                blackhole += Parse(lx).size();
+            }
+            auto s1 = chrono::high_resolution_clock::now();
+            double stream_ms =
+                chrono::duration<double, milli>(s1 - s0).count() /
+                double(RUNS);
+            auto tokens = LexStream(testCode);
+            size_t batchBytes = tokens.types.capacity() * sizeof(TokenType) +
+                                (tokens.offsets.capacity() +
+                                 tokens.lengths.capacity()) *
+                                    sizeof(uint32_t);
+            cout << "[Benchmark] Average per run (streaming lex+parse): "
+                 << stream_ms << " ms\n";
+            cout << "[Benchmark] Token memory: batch " << batchBytes
+                 << " bytes, streaming " << sizeof(StreamingLexer)
+                 << " bytes\n";
+        }
+
+        // Recognizer: the grammar without building nodes. Timed leniently,
+        // since a strict check stops at the first construct this parser
+        // doesn't cover; the strict verdict is reported alongside.
+        {
+            auto tokens = LexStream(testCode);
+            auto timeIt = [&](auto&& run) {
+                auto v0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i) run();
+                auto v1 = chrono::high_resolution_clock::now();
+                return chrono::duration<double, milli>(v1 - v0).count() /
+                       double(RUNS);
+            };
+            double recognizeMs = timeIt([&] {
+                blackhole += size_t(recognize(tokens, ParseOptions()).kind);
+            });
+            double parseMs = timeIt([&] { blackhole += Parse(tokens).size(); });
+            double lexRecognizeMs = timeIt([&] {
+                StreamingLexer lx(testCode, bestScanLevel(), nullptr);
+                blackhole += size_t(recognize(lx, ParseOptions()).kind);
+            });
+            double lexMs = timeIt([&] {
+                StreamingLexer lx(testCode, bestScanLevel(), nullptr);
+                for (size_t i = 0; lx.has(i); ++i) blackhole += lx.offset(i);
+            });
+            double lexParseMs = timeIt([&] {
+                auto t = LexStream(testCode);
+                blackhole += Parse(t).size();
+            });
+            ParseError e = Validate(tokens);
+            ParseOptions strict;
+            strict.strict = true;
+            ParseError p = Parse(tokens, strict).error;
+            bool same = e.kind == p.kind && e.offset == p.offset &&
+                        e.token == p.token;
+            auto x = [](double a, double b) { return a / (b > 0 ? b : 1e-9); };
+            cout << "[Benchmark] Recognizer: " << recognizeMs
+                 << " ms vs parse " << parseMs << " ms (x"
+                 << x(parseMs, recognizeMs) << "); streaming lex+recognize "
+                 << lexRecognizeMs << " ms vs lex+parse+discard "
+                 << lexParseMs << " ms (x" << x(lexParseMs, lexRecognizeMs)
+                 << "), of which streaming lexing alone " << lexMs << " ms\n";
+            cout << "[Benchmark] Validate (strict): ";
+            if (e)
+                cout << "line " << tokens.lines.line(e.offset) << ", column "
+                     << tokens.lines.column(e.offset) << ": " << describe(e);
+            else
+                cout << "ok";
+            cout << (same ? "" : "  [MISMATCH vs strict parse]") << "\n";
+        }
+
+        // Event API: counting nodes from events vs building the tree and
+        // walking it; the events are checked against the tree's
+        {
+            struct NodeCounter {
+                size_t nodes = 0;
+                void beginNode(ASTType, const NodeToken&) { ++nodes; }
+                void slot(Slot) {}
+                void endNode() {}
+            };
+            struct Recorder {
+                string log;
+                void beginNode(ASTType t, const NodeToken& k) {
+                    log += char(t);
+                    log.append((const char*)&k.offset, 4);
+                    log.append((const char*)&k.symbol, 4);
+                    log += char(k.number.kind);
+                    log.append((const char*)&k.number.i, 8);
+                    log += char(k.str.flags);
+                    log.append(k.text.data(), k.text.size());
+                    log += '\0';
+                }
+                void slot(Slot s) {
+                    log += 'S';
+                    log += char(s);
+                }
+                void endNode() { log += 'E'; }
+            };
+            auto tokens = LexStream(testCode);
+            NodeCounter counter;
+            auto e0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i) {
+                counter.nodes = 0;
+                ParseEvents(tokens, counter);
+                blackhole += counter.nodes;
+            }
+            auto e1 = chrono::high_resolution_clock::now();
+            size_t treeNodes = 0;
+            for (int i = 0; i < RUNS; ++i) {
+                ParseTree t = Parse(tokens);
+                treeNodes = 0;
+                for (size_t k = 0; k < t.size(); ++k)
+                    treeNodes += countNodes(t[k]);
+                blackhole += treeNodes;
+            }
+            auto e2 = chrono::high_resolution_clock::now();
+            Recorder fromEvents, fromTree;
+            ParseEvents(tokens, fromEvents);
+            ParseTree t = Parse(tokens);
+            for (size_t k = 0; k < t.size(); ++k) emitEvents(t[k], fromTree);
+            cout << "[Benchmark] Event parse (count " << counter.nodes
+                 << " nodes): "
+                 << chrono::duration<double, milli>(e1 - e0).count() /
+                        double(RUNS)
+                 << " ms vs parse+count "
+                 << chrono::duration<double, milli>(e2 - e1).count() /
+                        double(RUNS)
+                 << " ms"
+                 << (fromEvents.log == fromTree.log &&
+                             counter.nodes == treeNodes
+                         ? ""
+                         : "  [MISMATCH vs tree]")
+                 << "\n";
+        }
+
+        // Incremental reparsing: one-byte inserts and deletes at
+        // pseudo-random spots, each checked against a full lex+parse
+        {
+            Document doc(testCode);
+            mt19937 rng(2024);
+            const char kBytes[] = " x1+(\"'-[=]\n";
+            const int kEdits = 200;
+            double editMs = 0, settleMs = 0, fullMs = 0;
+            size_t reparsed = 0, fullParses = 0, mismatches = 0;
+            for (int i = 0; i < kEdits; ++i) {
+                uint32_t at = uint32_t(rng() % (doc.source().size() + 1));
+                bool erase = (i & 1) && at < doc.source().size();
+                char c = kBytes[rng() % (sizeof(kBytes) - 1)];
+                auto e0 = chrono::high_resolution_clock::now();
+                const Document::EditStats& st =
+                    doc.edit(at, erase ? 1 : 0, erase ? sv() : sv(&c, 1));
+                auto e1 = chrono::high_resolution_clock::now();
+                const ParseTree& tree = doc.tree();
+                auto e2 = chrono::high_resolution_clock::now();
+                reparsed += st.reparsedStatements;
+                fullParses += st.full;
+                auto tokens = LexStream(doc.source());
+                ParseTree full = Parse(tokens);
+                auto e3 = chrono::high_resolution_clock::now();
+                editMs += chrono::duration<double, milli>(e1 - e0).count();
+                settleMs += chrono::duration<double, milli>(e2 - e1).count();
+                fullMs += chrono::duration<double, milli>(e3 - e2).count();
+                const TokenStream& kept = doc.tokens();
+                bool same = kept.types == tokens.types &&
+                            kept.offsets == tokens.offsets &&
+                            kept.lengths == tokens.lengths &&
+                            tree.size() == full.size();
+                if (same && i % 10 == 0) {
+                    ostringstream a, b;
+                    for (size_t k = 0; k < full.size(); ++k) {
+                        printASTJson(tree[k], kept.lines, a);
+                        printASTJson(full[k], tokens.lines, b);
+                    }
+                    same = a.str() == b.str();
+                }
+                mismatches += !same;
+            }
+            cout << "[Benchmark] Incremental reparse (" << kEdits
+                 << " one-byte edits): " << editMs / kEdits
+                 << " ms per edit (+" << settleMs / kEdits
+                 << " ms moving offsets on read) vs full lex+parse "
+                 << fullMs / kEdits << " ms; " << double(reparsed) / kEdits
+                 << " statements reparsed per edit, " << fullParses
+                 << " full parses"
+                 << (mismatches ? "  [MISMATCH vs full parse]" : "") << "\n";
+        }
+
+        // String literal values: how many can be used straight from the
+        // source, and what decoding the rest costs
+        {
+            auto tokens = LexStream(testCode);
+            size_t literals = 0, zeroCopy = 0, decodedBytes = 0;
+            Arena arena;
+            auto d0 = chrono::high_resolution_clock::now();
+            for (size_t k = 0; k < tokens.size(); ++k) {
+                if (tokens.type(k) != TokenType::STRING) continue;
+                LuaString str = tokens.str(k);
+                ++literals;
+                zeroCopy += str.zeroCopy();
+                if (!str.zeroCopy()) decodedBytes += str.value(arena).size();
+            }
+            auto d1 = chrono::high_resolution_clock::now();
+            cout << "[Benchmark] String literals: " << literals
+                 << ", zero-copy "
+                 << (literals ? 100.0 * zeroCopy / literals : 100.0)
+                 << "%, decoded " << decodedBytes << " bytes in "
+                 << chrono::duration<double, milli>(d1 - d0).count()
+                 << " ms\n";
+        }
+
+        // Identifier interning, from a fresh table
+        {
+            SymbolTable symbols;
+            blackhole += LexStream(testCode, bestScanLevel(), symbols).size();
+            cout << "[Benchmark] Symbol table: " << symbols.size()
+                 << " names, " << symbols.lookups() << " lookups, hit rate "
+                 << (symbols.lookups()
+                         ? 100.0 * symbols.hits() / symbols.lookups()
+                         : 0.0)
+                 << "%\n";
+        }
+
+        // Identifier classification: branchy helpers + switch lookup vs
+        // the character-class table + perfect hash
+        {
+            auto tokens = LexStream(testCode);
+            vector<sv> words;
+            for (size_t k = 0; k < tokens.size(); ++k)
+                if (tokens.type(k) == TokenType::IDENTIFIER ||
+                    (tokens.type(k) >= TokenType::AND &&
+                     tokens.type(k) <= TokenType::WHILE))
+                    words.push_back(tokens.text(k));
+            size_t wordBytes = 0, mismatches = 0;
+            for (sv w : words) {
+                wordBytes += w.size();
+                mismatches += keywordTypeSwitch(w) != keywordTypeFast(w);
+            }
+            auto classify = [&](bool tables) {
+                auto c0 = chrono::high_resolution_clock::now();
+                size_t acc = 0;
+                for (int i = 0; i < RUNS; ++i)
+                    for (sv w : words) {
+                        size_t n = 1;
+                        if (tables)
+                            while (n < w.size() && is_alnum(w[n])) ++n;
+                        else
+                            while (n < w.size() && isAlnumBranchy(w[n])) ++n;
+                        sv word(w.data(), n);
+                        acc += (size_t)(tables ? keywordTypeFast(word)
+                                               : keywordTypeSwitch(word));
+                    }
+                blackhole += acc;
+                auto c1 = chrono::high_resolution_clock::now();
+                return chrono::duration<double>(c1 - c0).count();
+            };
+            double oldSecs = classify(false), newSecs = classify(true);
+            double mb = double(wordBytes) * RUNS / (1024.0 * 1024.0);
+            cout << "[Benchmark] Identifier classify (" << words.size()
+                 << " words): switch " << mb / (oldSecs > 0 ? oldSecs : 1e-9)
+                 << " MB/s, tables " << mb / (newSecs > 0 ? newSecs : 1e-9)
+                 << " MB/s"
+                 << (mismatches ? "  [MISMATCH between implementations]" : "")
+                 << "\n";
+        }
+
+        // Lexer-only throughput, scalar kernels vs the widest SIMD ones
+        auto reference = LexStream(testCode, ScanLevel::Scalar);
+        ScanLevel levels[] = {ScanLevel::Scalar, bestScanLevel()};
+        for (ScanLevel level : levels) {
+            auto l0 = chrono::high_resolution_clock::now();
+            for (int i = 0; i < RUNS; ++i)
+                blackhole += LexStream(testCode, level).size();
+            auto l1 = chrono::high_resolution_clock::now();
+            double secs = chrono::duration<double>(l1 - l0).count();
+            double mbps = double(testCode.size()) * RUNS / (1024.0 * 1024.0) /
+                          (secs > 0 ? secs : 1e-9);
+            auto check = LexStream(testCode, level);
+            bool same = check.types == reference.types &&
+                        check.offsets == reference.offsets &&
+                        check.lengths == reference.lengths;
+            cout << "[Benchmark] Lexer (" << scanLevelName(level)
+                 << "): " << mbps << " MB/s"
+                 << (same ? "" : "  [MISMATCH vs scalar tokens]") << "\n";
+            if (level == ScanLevel::Scalar && bestScanLevel() == level) break;
+        }
+
+        // Chunked parallel lexer, doubling the thread count up to the
+        // number of cores
+        {
+            unsigned cores = max(1u, thread::hardware_concurrency());
+            double base = 0;
+            SymbolTable seqSymbols;  // fresh tables, so ids can differ
+            auto sequential = LexStream(testCode, bestScanLevel(), seqSymbols);
+            for (unsigned threads = 1;; threads *= 2) {
+                threads = min(threads, cores);
+                auto p0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i)
+                    blackhole +=
+                        LexStreamParallel(testCode, threads, 4096).size();
+                auto p1 = chrono::high_resolution_clock::now();
+                double secs = chrono::duration<double>(p1 - p0).count();
+                double mbps = double(testCode.size()) * RUNS /
+                              (1024.0 * 1024.0) / (secs > 0 ? secs : 1e-9);
+                if (threads == 1) base = mbps;
+                SymbolTable parSymbols;
+                auto check =
+                    LexStreamParallel(testCode, threads, 4096, parSymbols);
+                bool same = check.types == reference.types &&
+                            check.offsets == reference.offsets &&
+                            check.lengths == reference.lengths &&
+                            check.aux == sequential.aux &&
+                            parSymbols.size() == seqSymbols.size();
+                cout << "[Benchmark] Parallel lexer (" << threads
+                     << " threads): " << mbps << " MB/s, x"
+                     << mbps / (base > 0 ? base : 1e-9)
+                     << (same ? "" : "  [MISMATCH vs scalar tokens]") << "\n";
+                if (threads == cores) break;
+            }
+        }
+
+        // Parallel parser on the same token stream, doubling the thread
+        // count up to the number of cores
+        {
+            unsigned cores = max(1u, thread::hardware_concurrency());
+            auto tokens = LexStream(testCode);
+            auto json = [&](const ParseTree& tree) {
+                ostringstream out;
+                for (size_t k = 0; k < tree.size(); ++k)
+                    printASTJson(tree[k], tokens.lines, out);
+                return out.str();
+            };
+            string reference = json(Parse(tokens));
+            double base = 0;
+            for (unsigned threads = 1;; threads *= 2) {
+                threads = min(threads, cores);
+                auto p0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i)
+                    blackhole +=
+                        ParseParallel(tokens, nullptr, threads, 4096).size();
+                auto p1 = chrono::high_resolution_clock::now();
+                double ms = chrono::duration<double, milli>(p1 - p0).count() /
+                            double(RUNS);
+                if (threads == 1) base = ms;
+                bool same =
+                    json(ParseParallel(tokens, nullptr, threads, 4096)) ==
+                    reference;
+                cout << "[Benchmark] Parallel parser (" << threads
+                     << " threads): " << ms << " ms, x"
+                     << base / (ms > 0 ? ms : 1e-9)
+                     << (same ? "" : "  [MISMATCH vs sequential parse]")
+                     << "\n";
+                if (threads == cores) break;
+            }
+        }
+
+        // Parallel JSON serializer on one tree, doubling the thread count
+        // up to the number of cores; the text must match the sequential one
+        {
+            unsigned cores = max(1u, thread::hardware_concurrency());
+            auto source = make_shared<const string>(testCode);
+            auto tokens = LexStream(*source);
+            ParseTree tree = Parse(tokens, source);
+            JsonWriter w;
+            writeChunkJson(tree, tokens.lines, w);
+            string reference = w.take();
+            double base = 0;
+            for (unsigned threads = 1;; threads *= 2) {
+                threads = min(threads, cores);
+                auto j0 = chrono::high_resolution_clock::now();
+                for (int i = 0; i < RUNS; ++i) {
+                    w.clear();
+                    writeChunkJsonParallel(tree, tokens.lines, w, 0, false,
+                                           threads, 4096);
+                    blackhole += w.data().size();
+                }
+                auto j1 = chrono::high_resolution_clock::now();
+                double secs = chrono::duration<double>(j1 - j0).count();
+                double mbps = double(reference.size()) * RUNS /
+                              (1024.0 * 1024.0) / (secs > 0 ? secs : 1e-9);
+                if (threads == 1) base = mbps;
+                cout << "[Benchmark] Parallel JSON (" << threads
+                     << " threads): " << mbps << " MB/s, x"
+                     << mbps / (base > 0 ? base : 1e-9)
+                     << (w.data() == reference ? ""
+                                               : "  [MISMATCH vs sequential]")
+                     << "\n";
+                if (threads == cores) break;
+            }
+        }
         cout << "\nPress Enter to exit...";
         cin.ignore();
         return 0;
     }
 
-    if (!filesystem::exists(filePath)) {
+    bool fromStdin = filePath == "-";
+    if (!fromStdin && !filesystem::exists(filePath)) {
         cerr << "Error: file not found -> " << filePath << "\n";
         return 1;
     }
 
-    ifstream in(filePath);
-    string code((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    // a saved AST is printed without parsing
+    if (!fromStdin && isBinaryAst(filePath)) {
+        MappedAst saved;
+        if (!saved.open(filePath) || !saved.verify()) {
+            cerr << "Error: unsupported or corrupt binary AST -> " << filePath
+                 << "\n";
+            return 1;
+        }
+        {
+            JsonWriter w(stdout);
+            writeChunkJson(saved, saved.lines(), w);
+            w.raw('\n');
+        }
+        cout << "\nPress Enter to exit...";
+        cin.ignore();
+        return 0;
+    }
+
+    // lexed and parsed in place: nodes view the mapping, which the tree
+    // keeps alive
+    auto code = make_shared<MappedFile>();
+    if (!(fromStdin ? code->openStdin() : code->open(filePath, true))) {
+        cerr << "Error: cannot read -> " << filePath << "\n";
+        return 1;
+    }
 
-    auto tokens = Lexer(code);
-    auto chunk = Parse(tokens);
+    auto tokens = LexStreamParallel(code->text());
+    auto chunk = ParseParallel(tokens, code);
+    if (chunk.error) {
+        cerr << "Parse error at line " << tokens.lines.line(chunk.error.offset)
+             << ": " << describe(chunk.error) << "\n";
+        return 1;
+    }
 
-    cout << "[\n";
-    for (size_t i = 0; i < chunk.size(); ++i) {
-        printASTJson(chunk[i], cout, 2);
-        if (i + 1 < chunk.size())
-            cout << ",\n";
-        else
-            cout << "\n";
+    {
+        JsonWriter w(stdout);  // large fwrite()s rather than many << calls
+        writeChunkJsonParallel(chunk, tokens.lines, w);
+        w.raw('\n');
     }
-    cout << "]\n";
     cout << "\nPress Enter to exit...";
     cin.ignore();
     return 0;